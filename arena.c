@@ -1,10 +1,24 @@
+#define _DEFAULT_SOURCE
 #include "arena.h"
+#include <stdio.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define HUGE_PAGE_SZ    ((size_t) 2 << 20)
+#define COMMIT_SZ       ((size_t) 1 << 16)
 
 arena_t arena;
 
+static size_t
+round_up(size_t n, size_t m)
+{
+    return (n + m - 1) / m * m;
+}
+
 arena_t
 arena_init(size_t cap)
 {
@@ -15,16 +29,102 @@ arena_init(size_t cap)
     assert(z.base);
     z.ptr = (uintptr_t) z.base;
     z.next_arena = NULL;
+    z.reserve = 0;
+    z.flags = 0;
+    return z;
+}
+
+// reserve address space only; pages are committed by arena_commit()
+arena_t
+arena_init_vm(size_t reserve, int flags)
+{
+    size_t align = (flags & ARENA_HUGEPAGES) ? HUGE_PAGE_SZ : (size_t) sysconf(_SC_PAGESIZE);
+    reserve = round_up(reserve, align);
+    assert(reserve > 0);
+
+    // over-reserve so the base can be aligned for huge pages, then trim
+    size_t map_sz = reserve + align;
+    char * p = mmap(NULL, map_sz, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    assert(p != MAP_FAILED);
+    char * base = (char *) round_up((uintptr_t) p, align);
+    if (base > p)
+        munmap(p, base - p);
+    if (p + map_sz > base + reserve)
+        munmap(base + reserve, (p + map_sz) - (base + reserve));
+
+    arena_t z;
+    z.base = base;
+    z.cap = 0;
+    z.ptr = (uintptr_t) base;
+    z.next_arena = NULL;
+    z.reserve = reserve;
+    z.flags = flags;
     return z;
 }
 
 void
 arena_deinit(arena_t * ap)
 {
-    if (ap->next_arena) {
-        arena_deinit(ap->next_arena);
+    if (ap->reserve) {
+        munmap(ap->base, ap->reserve);
+        return;
     }
     free(ap->base);
+    arena_t * next = ap->next_arena;
+    while (next) {
+        arena_t * tmp = next->next_arena;
+        free(next->base);
+        free(next);
+        next = tmp;
+    }
+}
+
+// Discard all allocations. A vm arena keeps its committed pages, so this is
+// O(1) and the next round of allocations makes no syscalls. A malloc arena
+// that has overflowed is coalesced into one block big enough for everything
+// it held, so it stops chaining in steady state.
+void
+arena_reset(arena_t * ap)
+{
+    if (ap->reserve || !ap->next_arena) {
+        ap->ptr = (uintptr_t) ap->base;
+        return;
+    }
+    size_t total = 0;
+    for (arena_t * zp = ap; zp; zp = zp->next_arena) {
+        total += zp->cap;
+    }
+    arena_deinit(ap);
+    *ap = arena_init(total);
+}
+
+static void
+arena_commit(arena_t * ap, uintptr_t end)
+{
+    // Allocations from a vm arena never move and sit end to end, which its
+    // users count on (xref.c's entries, intern.c's slots), so there is no
+    // chaining on another block once the reserve runs out.
+    size_t need = end - (uintptr_t) ap->base;
+    if (need > ap->reserve) {
+        fprintf(stderr, "arena: out of reserved address space (%zu bytes)\n", ap->reserve);
+        abort();
+    }
+    // the reserve is only rounded to pages, so it may end mid-granule
+    size_t gran = (ap->flags & ARENA_HUGEPAGES) ? HUGE_PAGE_SZ : COMMIT_SZ;
+    size_t new_cap = round_up(need, gran);
+    if (new_cap > ap->reserve)
+        new_cap = ap->reserve;
+    char * p = (char *) ap->base + ap->cap;
+    if (mprotect(p, new_cap - ap->cap, PROT_READ | PROT_WRITE) != 0) {
+        fprintf(stderr, "arena: can't commit %zu bytes: %s\n", new_cap - ap->cap, strerror(errno));
+        abort();
+    }
+#ifdef MADV_HUGEPAGE
+    if (ap->flags & ARENA_HUGEPAGES) {
+        madvise(p, new_cap - ap->cap, MADV_HUGEPAGE);
+    }
+#endif
+    ap->cap = new_cap;
 }
 
 void *
@@ -36,6 +136,11 @@ arena_alloc_align(arena_t * ap, size_t sz, size_t align)
         ap->ptr += sz;
         return old_p;
     }
+    if (ap->reserve) {
+        arena_commit(ap, ap->ptr + sz);
+        ap->ptr += sz;
+        return old_p;
+    }
     // this arena is full
     size_t new_cap = sz > (1 << 20) ? sz : (1 << 20);
     arena_t * new_arena = malloc(sizeof(*new_arena));
@@ -60,6 +165,29 @@ arena_realloc_align(arena_t * ap, void * ptr, size_t old_sz, size_t new_sz, size
     return new_p;
 }
 
+arena_mark_t
+arena_save(arena_t * ap)
+{
+    return (arena_mark_t) { .base = ap->base, .ptr = ap->ptr };
+}
+
+// Discard everything allocated since mark was saved. Blocks a malloc arena
+// chained on since then are freed; a vm arena keeps its committed pages, as
+// with arena_reset().
+void
+arena_restore(arena_t * ap, arena_mark_t mark)
+{
+    while (ap->base != mark.base) {
+        arena_t * next = ap->next_arena;
+        assert(!ap->reserve && next && "mark is not from this arena");
+        free(ap->base);
+        *ap = *next;
+        free(next);
+    }
+    assert(mark.ptr >= (uintptr_t) ap->base && mark.ptr <= ap->ptr);
+    ap->ptr = mark.ptr;
+}
+
 #if 0
 // TODO: is it possible to free the most recent allocation?
 static void *
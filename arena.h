@@ -6,19 +6,39 @@
 
 typedef struct arena_t arena_t;
 
+// An arena is either a chain of malloc'd blocks (arena_init) or a single
+// reserved range of address space whose pages are committed as the bump
+// pointer moves (arena_init_vm). For the latter, reserve != 0 and cap is the
+// number of bytes committed so far.
 struct arena_t {
     void * base;
     size_t cap;
     uintptr_t ptr;
     arena_t * next_arena;
+    size_t reserve;
+    int flags;
+};
+
+// position to roll an arena back to
+typedef struct {
+    void * base;        // block the position is in
+    uintptr_t ptr;
+} arena_mark_t;
+
+enum {
+    ARENA_HUGEPAGES = 1 << 0,   // ask for transparent huge pages (vm only)
 };
 
 extern arena_t arena;
 
 arena_t arena_init(size_t cap);
+arena_t arena_init_vm(size_t reserve, int flags);
 void    arena_deinit(arena_t * zp);
+void    arena_reset(arena_t * ap);
 void *  arena_alloc_align(arena_t * ap, size_t sz, size_t align);
 void *  arena_alloc(arena_t * ap, size_t sz);
 void *  arena_realloc_align(arena_t * ap, void * ptr, size_t old_sz, size_t new_sz, size_t align);
+arena_mark_t arena_save(arena_t * ap);
+void    arena_restore(arena_t * ap, arena_mark_t mark);
 
 #endif /* ARENA_H */
@@ -0,0 +1,137 @@
+#include "intern.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <assert.h>
+
+// The table is shared by every thread and takes no locks. A slot is 0, a
+// SEALED marker, or a pointer to its entry, with the top bits of the hash
+// in the pointer's unused top bits so most mismatches are rejected without
+// following it. Names hash to every page of a level alike, so level 0 is
+// small and each level after it is only allocated once it's needed, which
+// keeps the table's size in step with the number of names. An insert claims
+// the first empty slot on its probe sequence with a CAS; if another thread
+// got there first with the same string, the insert takes its entry instead.
+// Entries come from an arena per thread, so inserts share nothing but the
+// slots.
+//
+// To grow without stopping anyone, the table is a series of levels, each
+// twice the size of the last. Once a level is half full it is sealed: a
+// probe that reaches an empty slot in it claims that slot with SEALED and
+// carries on into the next level. A slot only ever goes from 0 to an entry
+// or to SEALED, so every thread looking for a string walks the same
+// sequence and stops at the same place.
+#define LEVEL0_SLOTS    ((size_t) 1 << 16)
+#define MAX_LEVELS      16
+#define SEALED          1
+#define TAG_SHIFT       48
+#define PTR_MASK        (((uint64_t) 1 << TAG_SHIFT) - 1)
+
+typedef struct {
+    uint32_t len;
+    char s[];
+} intern_entry_t;
+
+static uint64_t * levels[MAX_LEVELS];   // level k has LEVEL0_SLOTS << k slots
+static size_t level_used[MAX_LEVELS];
+
+// never freed, even when its thread exits, since interned strings live
+// until the end of the process
+static __thread arena_t entry_arena;
+
+// FNV-1a
+static uint64_t
+hash_str(const char * s, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t *
+get_level(int k)
+{
+    uint64_t * tab = __atomic_load_n(&levels[k], __ATOMIC_ACQUIRE);
+    if (tab)
+        return tab;
+    // first use; if another thread beats us to it, use its table
+    size_t sz = sizeof(*tab)*(LEVEL0_SLOTS << k);
+    arena_t a = arena_init_vm(sz, 0);
+    uint64_t * mine = arena_alloc(&a, sz);
+    if (__atomic_compare_exchange_n(&levels[k], &tab, mine, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return mine;
+    arena_deinit(&a);
+    return tab;
+}
+
+static intern_entry_t *
+new_entry(const char * s, size_t len)
+{
+    intern_entry_t * ep = arena_alloc_align(&entry_arena, sizeof(*ep) + len+1, sizeof(uint32_t));
+    assert(((uintptr_t) ep & ~PTR_MASK) == 0 && "pointer too wide to tag");
+    ep->len = (uint32_t) len;
+    memcpy(ep->s, s, len);
+    ep->s[len] = '\0';
+    return ep;
+}
+
+const char *
+intern(const char * s, size_t len)
+{
+    uint64_t h = hash_str(s, len);
+    uint64_t tag = h & ~PTR_MASK;
+    intern_entry_t * new_ep = NULL;
+    arena_mark_t mark = { 0 };
+
+    for (int k = 0; k < MAX_LEVELS; k++) {
+        uint64_t * tab = get_level(k);
+        size_t mask = (LEVEL0_SLOTS << k) - 1;
+        bool sealed = __atomic_load_n(&level_used[k], __ATOMIC_RELAXED) >= (mask+1)/2;
+        for (size_t i = h & mask; ; i = (i+1) & mask) {
+            uint64_t v = __atomic_load_n(&tab[i], __ATOMIC_ACQUIRE);
+            if (v == 0 && sealed) {
+                if (__atomic_compare_exchange_n(&tab[i], &v, SEALED, false,
+                                                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+                    break;
+            } else if (v == 0) {
+                if (!new_ep) {
+                    if (!entry_arena.base)
+                        entry_arena = arena_init(1<<16);
+                    mark = arena_save(&entry_arena);
+                    new_ep = new_entry(s, len);
+                }
+                if (__atomic_compare_exchange_n(&tab[i], &v, tag | (uintptr_t) new_ep, false,
+                                                __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+                    __atomic_fetch_add(&level_used[k], 1, __ATOMIC_RELAXED);
+                    return new_ep->s;
+                }
+            }
+            // v is what's in the slot, perhaps put there by a thread that
+            // beat us to it
+            if (v == SEALED)
+                break;
+            if ((v & ~PTR_MASK) == tag) {
+                intern_entry_t * ep = (intern_entry_t *)(uintptr_t)(v & PTR_MASK);
+                if (ep->len == len && memcmp(ep->s, s, len) == 0) {
+                    if (new_ep)
+                        arena_restore(&entry_arena, mark);
+                    return ep->s;
+                }
+            }
+        }
+    }
+    fprintf(stderr, "too many distinct names\n");
+    exit(EXIT_FAILURE);
+}
+
+const char *
+intern_cstr(const char * s)
+{
+    return intern(s, strlen(s));
+}
@@ -0,0 +1,11 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+
+// Interned strings are canonical: two interned strings are equal iff their
+// pointers are equal. They live until the end of the process.
+const char * intern(const char * s, size_t len);
+const char * intern_cstr(const char * s);
+
+#endif /* INTERN_H */
@@ -1,11 +1,25 @@
+#define _POSIX_C_SOURCE 200809L
 #include "arena.h"
 #include "parser.h"
+#include "tokenizer.h"
+#include "symtab.h"
+#include "pp.h"
+#include "srcloc.h"
+#include "structidx.h"
+#include "push.h"
+#include "xref.h"
+#include "intern.h"
+#include "query.h"
+#include "serve.h"
+#include "ptrmap.h"
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <unistd.h>
 
 #if 0
 typedef struct node_t node_t;
@@ -124,18 +138,416 @@ print_node(node_t * np, int depth)
 }
 #endif
 
-int main(int argc, char * argv[])
+static bool
+parse_and_print(const char * path)
 {
-#if 1
-    (void) argc;
-    (void) argv;
-    arena = arena_init(1<<20);
+    if (path && !pp_run(path))
+        return false;
     ast_node_t * ast = parse_tu();
-    if (!ast)
-        return EXIT_FAILURE;
+    if (!ast) {
+        fprintf(stderr, "%s: parse error\n", path ? path : "<builtin>");
+        return false;
+    }
     ast_print(ast, stdout);
+    return true;
+}
+
+static bool
+print_decl(ast_node_t * decl, void * ctx)
+{
+    ast_print(decl, stdout);
+    return false;
+}
+
+static bool
+drop_decl(ast_node_t * decl, void * ctx)
+{
+    return false;
+}
+
+// Parse preprocessed source from stdin, passing each declaration to fn as
+// soon as it has been read. With keep_locs, the locations of declarations
+// fn drops stay good, for the cross-reference index.
+static bool
+parse_stdin(parse_decl_fn fn, void * ctx, bool keep_locs)
+{
+    push_parser_t * ps = push_parser_new("<stdin>", fn, ctx);
+    if (keep_locs)
+        push_parser_keep_locs(ps);
+    char buf[1 << 16];
+    bool ok = true;
+    ssize_t n;
+    while (ok && (n = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+        ok = push_parser_feed(ps, buf, (size_t) n);
+    }
+    ok = ok && n == 0 && push_parser_finish(ps);
+    push_parser_free(ps);
+    return ok;
+}
+
+// only check that path parses, saying where it doesn't
+static bool
+check(const char * path)
+{
+    if (path && strcmp(path, "-") == 0)
+        return parse_stdin(drop_decl, NULL, false);
+    if (path && !pp_run(path))
+        return false;
+    uint32_t loc;
+    if (!recognize_tu(&loc)) {
+        // the preprocessor's end of file token has no location
+        srcpos_t pos = srcloc_decode(loc);
+        if (loc)
+            fprintf(stderr, "%s:%d:%d: syntax error\n", pos.file, pos.line, pos.col);
+        else
+            fprintf(stderr, "%s: syntax error at end of file\n", path ? path : "<builtin>");
+        return false;
+    }
+    return true;
+}
+
+typedef struct {
+    parse_decl_fn fn;
+    void * ctx;
+    bool parsed;
+} stream_ctx_t;
+
+static int
+parse_window(bool at_end, void * ctx)
+{
+    stream_ctx_t * sc = ctx;
+    int n = parse_tu_window(sc->fn, sc->ctx, at_end);
+    sc->parsed = n >= 0;
+    return n;
+}
+
+// Parse path a declaration at a time as it's preprocessed, so its tokens
+// are only held a window at a time. Without a path, parse the tokens the
+// tokenizer already has.
+static bool
+parse_stream(const char * path, parse_decl_fn fn, void * ctx)
+{
+    if (path && strcmp(path, "-") == 0)
+        return parse_stdin(fn, ctx, false);
+    if (!path) {
+        if (parse_tu_stream(fn, ctx))
+            return true;
+        fprintf(stderr, "<builtin>: parse error\n");
+        return false;
+    }
+    stream_ctx_t sc = { .fn = fn, .ctx = ctx, .parsed = true };
+    if (pp_run_stream(path, parse_window, &sc))
+        return true;
+    // errors from the preprocessor have already been reported
+    if (!sc.parsed)
+        fprintf(stderr, "%s: parse error\n", path);
+    return false;
+}
+
+// parse path for the cross-reference index alone
+static bool
+index_file(const char * path)
+{
+    if (path && strcmp(path, "-") == 0)
+        return parse_stdin(drop_decl, NULL, true);
+    return parse_stream(path, drop_decl, NULL);
+}
+
+static void
+print_xrefs(const xref_t * xp)
+{
+    for (; xp; xp = xref_next(xp)) {
+        srcpos_t pos = srcloc_decode(xp->loc);
+        printf("%s:%d:%d: %s\n", pos.file, pos.line, pos.col, xref_kind_str(xp->kind));
+    }
+}
+
+// file:line:col of np, or just path for shared nodes without a location
+static void
+print_node_loc(ast_node_t * np, const char * path)
+{
+    if (ast_loc(np)) {
+        srcpos_t pos = srcloc_decode(ast_loc(np));
+        printf("%s:%d:%d", pos.file, pos.line, pos.col);
+    } else {
+        printf("%s", path);
+    }
+}
+
+static void
+print_match(int query, ast_node_t * np, const query_capture_t * caps, int num_caps, void * ctx)
+{
+    print_node_loc(np, ctx);
+    printf(": query %d\n", query+1);
+    for (int i = 0; i < num_caps; i++) {
+        printf("  @%s ", caps[i].name);
+        print_node_loc(caps[i].node, ctx);
+        if (ast_str(caps[i].node))
+            printf(" (%s)", ast_str(caps[i].node));
+        printf("\n");
+    }
+}
+
+typedef struct {
+    query_set_t * qs;
+    const char * path;
+} query_ctx_t;
+
+// a match in a shared declaration, kept to be printed again wherever a
+// declaration equal to it turns up
+typedef struct {
+    int query;
+    ast_node_t * node;
+    query_capture_t * caps;
+    int num_caps;
+} cached_match_t;
+
+typedef struct {
+    cached_match_t * matches;
+    int num_matches;
+} match_list_t;
+
+static ptrmap_t decl_matches;   // shared declaration -> match_list_t
+static ptrmap_t node_map;       // node of a shared declaration -> its copy
+
+static void
+cache_match(int query, ast_node_t * np, const query_capture_t * caps, int num_caps, void * ctx)
+{
+    match_list_t * ml = ctx;
+    ml->matches = realloc(ml->matches, sizeof(*ml->matches)*(ml->num_matches + 1));
+    assert(ml->matches);
+    query_capture_t * cp = NULL;
+    if (num_caps > 0) {
+        cp = malloc(sizeof(*cp)*num_caps);
+        assert(cp);
+        memcpy(cp, caps, sizeof(*cp)*num_caps);
+    }
+    ml->matches[ml->num_matches++] = (cached_match_t) {
+        .query = query, .node = np, .caps = cp, .num_caps = num_caps,
+    };
+}
+
+// map each node of shared to the one in the same place in decl, which is
+// equal to it
+static void
+map_nodes(ast_node_t * shared, ast_node_t * decl)
+{
+    ptrmap_put(&node_map, shared, decl);
+    for (size_t i = 0; i < ast_num_children(shared); i++) {
+        map_nodes(ast_child(shared, i), ast_child(decl, i));
+    }
+}
+
+// The queries only run on the first of a set of equal declarations, in its
+// shared copy; the matches are printed at each one's own locations.
+static bool
+query_decl(ast_node_t * decl, void * ctx)
+{
+    query_ctx_t * qc = ctx;
+    bool seen;
+    ast_node_t * shared = ast_share_decl(decl, &seen);
+    match_list_t * ml = ptrmap_get(&decl_matches, shared);
+    if (!ml) {
+        ml = calloc(1, sizeof(*ml));
+        assert(ml);
+        query_run(qc->qs, shared, cache_match, ml);
+        ptrmap_put(&decl_matches, shared, ml);
+    }
+    if (ml->num_matches == 0)
+        return false;
+    // the shared copy of the first has its locations already
+    if (seen) {
+        ptrmap_clear(&node_map);
+        map_nodes(shared, decl);
+    }
+    int max_caps = 1;
+    for (int i = 0; i < ml->num_matches; i++) {
+        if (ml->matches[i].num_caps > max_caps)
+            max_caps = ml->matches[i].num_caps;
+    }
+    query_capture_t caps[max_caps];
+    for (int i = 0; i < ml->num_matches; i++) {
+        cached_match_t * mp = &ml->matches[i];
+        for (int j = 0; j < mp->num_caps; j++) {
+            caps[j] = (query_capture_t) {
+                .name = mp->caps[j].name,
+                .node = seen ? ptrmap_get(&node_map, mp->caps[j].node) : mp->caps[j].node,
+            };
+        }
+        ast_node_t * np = seen ? ptrmap_get(&node_map, mp->node) : mp->node;
+        print_match(mp->query, np, caps, mp->num_caps, (void *) qc->path);
+    }
+    return false;
+}
+
+// run the queries in qs over each top-level declaration in path, printing
+// their matches
+static bool
+query_file(const char * path, query_set_t * qs)
+{
+    query_ctx_t qc = { .qs = qs, .path = !path ? "<builtin>" : strcmp(path, "-") == 0 ? "<stdin>" : path };
+    return parse_stream(path, query_decl, &qc);
+}
+
+// print where each top-level declaration in path is, from the structural
+// index alone
+static bool
+print_decls(const char * path)
+{
+    bool is_stdin = strcmp(path, "-") == 0;
+    FILE * f = is_stdin ? stdin : fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return false;
+    }
+    if (is_stdin)
+        path = "<stdin>";
+    size_t len = 0, cap = 1 << 16;
+    char * text = malloc(cap);
+    assert(text);
+    for (size_t n; (n = fread(text + len, 1, cap - len, f)) > 0; ) {
+        len += n;
+        if (len == cap) {
+            cap *= 2;
+            text = realloc(text, cap);
+            assert(text);
+        }
+    }
+    if (f != stdin)
+        fclose(f);
+
+    // text stays registered with srcloc, so it's never freed
+    uint32_t base = srcloc_add_file(path, text, len);
+    structidx_t ix = structidx_build(text, len);
+    decl_span_t * spans;
+    size_t num_spans = structidx_decls(text, len, &ix, &spans);
+    for (size_t i = 0; i < num_spans; i++) {
+        srcpos_t b = srcloc_decode(base + spans[i].begin);
+        srcpos_t e = srcloc_decode(base + spans[i].end - 1);
+        printf("%s:%d:%d-%d:%d\n", b.file, b.line, b.col, e.line, e.col);
+    }
+    free(spans);
+    structidx_free(&ix);
+    return true;
+}
+
+// argument of option argv[*ip], either attached (-Ifoo) or the next one
+static const char *
+opt_arg(int argc, char * argv[], int * ip)
+{
+    const char * arg = argv[*ip][2] ? &argv[*ip][2] : (*ip+1 < argc ? argv[++*ip] : NULL);
+    if (!arg) {
+        fprintf(stderr, "%.2s requires an argument\n", argv[*ip]);
+        exit(EXIT_FAILURE);
+    }
+    return arg;
+}
+
+// usage: crdp [-I DIR]... [-j THREADS]
+//             [--decls | --check | --xref NAME | --query PATTERN...] [FILE]...
+//        crdp [-I DIR]... [-j THREADS] [--check] --serve SOCKET
+// with no files, parses a built-in token list; a FILE of - is preprocessed
+// source read from stdin; --decls only lists where each file's top-level
+// declarations are, without preprocessing or parsing; --check only checks
+// syntax, printing nothing for a file that parses; --xref lists where NAME
+// is declared and then where it's used, across all files; --query, which
+// can be given any number of times, lists the matches of each PATTERN (see
+// query.h) in each top-level declaration, numbered in the order given;
+// --serve answers parse requests on a Unix domain socket, or on stdin and
+// stdout for -, instead of parsing files given (see serve.h)
+//
+//        crdp --connect SOCKET FILE...
+// has the server on SOCKET parse each FILE, printing what it sends back
+int main(int argc, char * argv[])
+{
+#if 1
+    if (argc >= 3 && strcmp(argv[1], "--connect") == 0)
+        return serve_connect(argv[2], argv + 3, argc - 3) ? EXIT_SUCCESS : EXIT_FAILURE;
+
+    arena = arena_init_vm((size_t) 1 << 34, 0);
+    tokenizer_init();
+
+    const char ** files = malloc(sizeof(*files)*argc);
+    assert(files);
+    int num_files = 0;
+    bool ok = true;
+    bool decls = false;
+    bool check_only = false;
+    const char * xref_name = NULL;
+    query_set_t * qs = NULL;
+    const char * serve_path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--decls") == 0) {
+            decls = true;
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check_only = true;
+        } else if (strcmp(argv[i], "--xref") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "--xref requires an argument\n");
+                exit(EXIT_FAILURE);
+            }
+            xref_name = intern_cstr(argv[++i]);
+        } else if (strcmp(argv[i], "--query") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "--query requires an argument\n");
+                exit(EXIT_FAILURE);
+            }
+            if (!qs)
+                qs = query_set_new();
+            if (!query_add(qs, argv[++i]))
+                exit(EXIT_FAILURE);
+        } else if (strcmp(argv[i], "--serve") == 0) {
+            if (i+1 >= argc) {
+                fprintf(stderr, "--serve requires an argument\n");
+                exit(EXIT_FAILURE);
+            }
+            serve_path = argv[++i];
+        } else if (strncmp(argv[i], "-I", 2) == 0) {
+            pp_add_include_dir(opt_arg(argc, argv, &i));
+        } else if (strncmp(argv[i], "-j", 2) == 0) {
+            // threads for lexing big files; the default is one per CPU
+            tokenizer_set_threads(atoi(opt_arg(argc, argv, &i)));
+        } else {
+            files[num_files++] = argv[i];
+        }
+    }
+    if (serve_path)
+        num_files = 0;
+    for (int i = 0; i < num_files; i++) {
+        if (decls)
+            ok &= print_decls(files[i]);
+        else if (check_only)
+            ok &= check(files[i]);
+        else if (xref_name)
+            ok &= index_file(files[i]);
+        else if (qs)
+            ok &= query_file(files[i], qs);
+        else if (strcmp(files[i], "-") == 0)
+            ok &= parse_stdin(print_decl, NULL, false);
+        else
+            ok &= parse_and_print(files[i]);
+        // each file is its own translation unit
+        arena_reset(&arena);
+        symtab_rollback(0);
+    }
+    if (serve_path) {
+        ok = serve(serve_path, check_only);
+    } else if (num_files == 0) {
+        ok = check_only ? check(NULL) :
+             xref_name ? index_file(NULL) :
+             qs ? query_file(NULL, qs) :
+             parse_and_print(NULL);
+    }
+    if (xref_name) {
+        print_xrefs(xref_decls(xref_name));
+        print_xrefs(xref_uses(xref_name));
+    }
+
+    if (qs)
+        query_set_free(qs);
+    free(files);
     arena_deinit(&arena);
-    return EXIT_SUCCESS;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
 #else
     //node_t * np = f("a+&b*c^-d");
     node_t * np = f("a*b-c+d*e+f");
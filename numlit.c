@@ -0,0 +1,558 @@
+#include "numlit.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <assert.h>
+
+// Integer and floating literals are decoded once, when they're lexed.
+// Decimal digit runs are converted eight at a time, and floats are rounded
+// with Clinger's fast path when it's exact, then with the Eisel-Lemire
+// algorithm, and only fall back to strtod() when that can't decide.
+
+#define MAX_SIG_DIGITS  19      // every 19 digit decimal fits in 64 bits
+#define POW5_MIN        (-342)  // below this every double literal is 0
+#define POW5_MAX        308     // above this every double literal is inf
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define SWAR_DIGITS 1
+#else
+#define SWAR_DIGITS 0
+#endif
+
+size_t
+numlit_len(const char * p, const char * end)
+{
+    const char * start = p;
+    if (p < end && *p == '.')
+        p++;
+    if (p >= end || !isdigit((unsigned char) *p))
+        return 0;
+    for (p++; p < end; p++) {
+        char c = *p;
+        if ((c == 'e' || c == 'E' || c == 'p' || c == 'P') && p+1 < end && (p[1] == '+' || p[1] == '-'))
+            p++;
+        else if (c != '.' && c != '_' && !isalnum((unsigned char) c))
+            break;
+    }
+    return p - start;
+}
+
+static unsigned
+digit_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return 99;
+}
+
+#if SWAR_DIGITS
+static uint64_t
+load8(const char * p)
+{
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static bool
+is_eight_digits(uint64_t v)
+{
+    return !(((v + 0x4646464646464646) | (v - 0x3030303030303030)) & 0x8080808080808080);
+}
+
+// value of eight ASCII digits, first digit in the low byte
+static uint32_t
+eight_digits(uint64_t v)
+{
+    v = ((v & 0x0F0F0F0F0F0F0F0F) * 2561) >> 8;
+    v = ((v & 0x00FF00FF00FF00FF) * 6553601) >> 16;
+    return (uint32_t) (((v & 0x0000FFFF0000FFFF) * 42949672960001) >> 32);
+}
+#endif
+
+// u, l, ll in any order and case, but ll can't be lL
+static bool
+int_suffix(const char * p, const char * end, uint16_t * flags)
+{
+    bool u = false, l = false;
+    while (p < end) {
+        if ((*p == 'u' || *p == 'U') && !u) {
+            u = true;
+            *flags |= TF_NUM_U;
+            p++;
+        } else if ((*p == 'l' || *p == 'L') && !l) {
+            l = true;
+            if (p+1 < end && p[1] == p[0]) {
+                *flags |= TF_NUM_LL;
+                p += 2;
+            } else {
+                *flags |= TF_NUM_L;
+                p++;
+            }
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void
+decode_int(const char * p, const char * end, token_t * t)
+{
+    uint64_t v = 0;
+    unsigned base = 10;
+    bool overflow = false;
+    t->typ = TOK_LITERAL_INT;
+    if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        base = 16;
+        p += 2;
+    } else if (end - p >= 2 && p[0] == '0' && (p[1] == 'b' || p[1] == 'B')) {
+        base = 2;
+        p += 2;
+    } else if (p[0] == '0') {
+        base = 8;
+    }
+    const char * digits = p;
+#if SWAR_DIGITS
+    if (base == 10) {
+        while (end - p >= 8 && is_eight_digits(load8(p))) {
+            uint32_t d8 = eight_digits(load8(p));
+            if (v > (UINT64_MAX - d8) / 100000000)
+                overflow = true;
+            v = v*100000000 + d8;
+            p += 8;
+        }
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned d = digit_value(*p);
+        if (d >= base)
+            break;
+        if (v > (UINT64_MAX - d) / base)
+            overflow = true;
+        v = v*base + d;
+    }
+    t->u.i = v;     // wraps on overflow
+    // a literal's type depends on it, and macro-expanded tokens are located
+    // where the macro was used, so their text can't be looked at later
+    if (base == 10)
+        t->flags |= TF_NUM_DECIMAL;
+    if (overflow)
+        t->flags |= TF_NUM_OVERFLOW;
+    if (p == digits || !int_suffix(p, end, &t->flags))
+        t->flags |= TF_NUM_INVALID;
+}
+
+// 128-bit truncated powers of five, 5^q scaled so the top bit is set, for
+// POW5_MIN <= q <= POW5_MAX: [0] holds the high word and [1] the low word.
+// Negative powers are rounded up. Worked out with a small bignum the first
+// time Eisel-Lemire runs rather than kept as a 10k table in the source.
+static uint64_t pow5_128[POW5_MAX - POW5_MIN + 1][2];
+static bool pow5_ready;
+
+#define BIG_LIMBS 64
+
+typedef struct {
+    uint32_t l[BIG_LIMBS];  // least significant first
+    int n;
+} big_t;
+
+static void
+big_mul_small(big_t * a, uint32_t m)
+{
+    uint64_t carry = 0;
+    for (int i = 0; i < a->n; i++) {
+        uint64_t x = (uint64_t) a->l[i]*m + carry;
+        a->l[i] = (uint32_t) x;
+        carry = x >> 32;
+    }
+    if (carry) {
+        assert(a->n < BIG_LIMBS);
+        a->l[a->n++] = (uint32_t) carry;
+    }
+}
+
+static int
+big_bitlen(const big_t * a)
+{
+    if (a->n == 0)
+        return 0;
+    uint32_t top = a->l[a->n-1];
+    int bits = 0;
+    while (top) {
+        bits++;
+        top >>= 1;
+    }
+    return (a->n-1)*32 + bits;
+}
+
+static unsigned
+big_bit(const big_t * a, int i)
+{
+    if (i < 0 || i >= a->n*32)
+        return 0;
+    return (a->l[i/32] >> (i%32)) & 1;
+}
+
+// bits [lo, lo+64) of a, with zeros below bit 0
+static uint64_t
+big_bits64(const big_t * a, int lo)
+{
+    uint64_t v = 0;
+    for (int i = 63; i >= 0; i--) {
+        v = v << 1 | big_bit(a, lo + i);
+    }
+    return v;
+}
+
+// a /= m, rounded down
+static void
+big_div_small(big_t * a, uint32_t m)
+{
+    uint64_t rem = 0;
+    for (int i = a->n-1; i >= 0; i--) {
+        uint64_t x = rem << 32 | a->l[i];
+        a->l[i] = (uint32_t) (x / m);
+        rem = x % m;
+    }
+    while (a->n > 0 && a->l[a->n-1] == 0) {
+        a->n--;
+    }
+}
+
+// r = a >> k
+static void
+big_shr(const big_t * a, int k, big_t * r)
+{
+    r->n = a->n - k/32;
+    for (int i = 0; i < r->n; i++) {
+        uint64_t x = a->l[i + k/32] | (i + k/32 + 1 < a->n ? (uint64_t) a->l[i + k/32 + 1] << 32 : 0);
+        r->l[i] = (uint32_t) (x >> (k%32));
+    }
+    while (r->n > 0 && r->l[r->n-1] == 0) {
+        r->n--;
+    }
+}
+
+static void
+big_add1(big_t * a)
+{
+    for (int i = 0; i < a->n; i++) {
+        if (++a->l[i] != 0)
+            return;
+    }
+    assert(a->n < BIG_LIMBS);
+    a->l[a->n++] = 1;
+}
+
+void
+numlit_init()
+{
+    if (pow5_ready)
+        return;
+
+    // recip is 2^RECIP_BITS / 5^q, rounded down; dividing it by 5 again
+    // keeps it exact because floor(floor(x/a)/b) == floor(x/(a*b))
+    enum { RECIP_BITS = 1792 };
+    big_t p = { .l = { 1 }, .n = 1 };
+    big_t recip = { .n = RECIP_BITS/32 + 1 };
+    recip.l[RECIP_BITS/32] = 1;
+    for (int q = 0; q <= -POW5_MIN; q++) {
+        if (q <= POW5_MAX) {
+            int len = big_bitlen(&p);
+            pow5_128[q - POW5_MIN][0] = big_bits64(&p, len - 64);
+            pow5_128[q - POW5_MIN][1] = big_bits64(&p, len - 128);
+        }
+        if (q > 0) {
+            // 5^-q as 2^b / 5^q, one more than rounded down; the smaller
+            // powers need fewer bits to make the rounding up exact
+            big_t r;
+            int z = big_bitlen(&p);
+            int b = q <= 27 ? z + 127 : 2*z + 128;
+            assert(b <= RECIP_BITS);
+            big_shr(&recip, RECIP_BITS - b, &r);
+            big_add1(&r);
+            int len = big_bitlen(&r);
+            pow5_128[-q - POW5_MIN][0] = big_bits64(&r, len - 64);
+            pow5_128[-q - POW5_MIN][1] = big_bits64(&r, len - 128);
+        }
+        big_mul_small(&p, 5);
+        big_div_small(&recip, 5);
+    }
+    pow5_ready = true;
+}
+
+// full product of a and b; returns the high word
+static uint64_t
+mul128(uint64_t a, uint64_t b, uint64_t * lo)
+{
+#ifdef __SIZEOF_INT128__
+    unsigned __int128 r = (unsigned __int128) a*b;
+    *lo = (uint64_t) r;
+    return (uint64_t) (r >> 64);
+#else
+    uint64_t a_lo = (uint32_t) a, a_hi = a >> 32;
+    uint64_t b_lo = (uint32_t) b, b_hi = b >> 32;
+    uint64_t ll = a_lo*b_lo, lh = a_lo*b_hi, hl = a_hi*b_lo, hh = a_hi*b_hi;
+    uint64_t mid = (ll >> 32) + (uint32_t) lh + (uint32_t) hl;
+    *lo = (mid << 32) | (uint32_t) ll;
+    return hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+}
+
+static double
+double_from_bits(uint64_t bits)
+{
+    double d;
+    memcpy(&d, &bits, sizeof(d));
+    return d;
+}
+
+#define DOUBLE_INF_BITS 0x7FF0000000000000ull
+
+// Eisel-Lemire: the double nearest w * 10^q. Returns false in the rare case
+// where the 128-bit product isn't precise enough to round correctly.
+static bool
+eisel_lemire(uint64_t w, long q, double * out)
+{
+    if (w == 0 || q < POW5_MIN) {
+        *out = 0.0;
+        return true;
+    }
+    if (q > POW5_MAX) {
+        *out = double_from_bits(DOUBLE_INF_BITS);
+        return true;
+    }
+    if (!pow5_ready)
+        numlit_init();
+
+    int lz = __builtin_clzll(w);
+    w <<= lz;
+    const uint64_t * pw = pow5_128[q - POW5_MIN];
+    uint64_t lo;
+    uint64_t hi = mul128(w, pw[0], &lo);
+    if ((hi & 0x1FF) == 0x1FF) {
+        // the bits below the mantissa may carry, so take the next word too
+        uint64_t lo2;
+        uint64_t hi2 = mul128(w, pw[1], &lo2);
+        lo += hi2;
+        if (hi2 > lo)
+            hi++;
+    }
+    if (lo == UINT64_MAX && (q < -27 || q > 55))
+        return false;
+
+    int upperbit = (int) (hi >> 63);
+    uint64_t m = hi >> (upperbit + 9);
+    // floor(log2(10^q)) + 63, biased
+    int p2 = (int) ((((152170 + 65536) * q) >> 16) + 63) + upperbit - lz + 1023;
+    if (p2 <= 0) {
+        // subnormal
+        if (-p2 + 1 >= 64) {
+            *out = 0.0;
+            return true;
+        }
+        m >>= -p2 + 1;
+        m += m & 1;
+        m >>= 1;
+        p2 = m < (1ull << 52) ? 0 : 1;
+        *out = double_from_bits(m | (uint64_t) p2 << 52);
+        return true;
+    }
+    if (lo <= 1 && q >= -4 && q <= 23 && (m & 3) == 1) {
+        // exactly halfway: round to even rather than up
+        if ((m << (upperbit + 9)) == hi)
+            m &= ~(uint64_t) 1;
+    }
+    m += m & 1;
+    m >>= 1;
+    if (m >= (2ull << 52)) {
+        m = 1ull << 52;
+        p2++;
+    }
+    m &= ~(1ull << 52);
+    if (p2 >= 0x7FF) {
+        *out = double_from_bits(DOUBLE_INF_BITS);
+        return true;
+    }
+    *out = double_from_bits(m | (uint64_t) p2 << 52);
+    return true;
+}
+
+static const double pow10_exact[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// strtod() on [p, end); sets *ok if all of it was used
+static double
+slow_path(const char * p, const char * end, bool is_float, bool * ok)
+{
+    char buf[128];
+    char * s = buf;
+    char * s_end;
+    size_t n = end - p;
+    if (n >= sizeof(buf)) {
+        s = malloc(n+1);
+        assert(s);
+    }
+    memcpy(s, p, n);
+    s[n] = '\0';
+    double d = is_float ? strtof(s, &s_end) : strtod(s, &s_end);
+    *ok = (s_end == s + n);
+    if (s != buf)
+        free(s);
+    return d;
+}
+
+// (float) d, unless d sits exactly between two floats, where rounding the
+// decimal twice can differ from rounding it once
+static double
+round_to_float(double d, const char * p, const char * end)
+{
+    float f = (float) d;
+    double fd = f;
+    uint32_t bits;
+    memcpy(&bits, &f, sizeof(bits));
+    if (bits == 0x7F800000)
+        fd = 0x1p128;   // rounded up past FLT_MAX
+    if (fd != d) {
+        float g;
+        bits += fd < d ? 1 : -1;
+        memcpy(&g, &bits, sizeof(g));
+        if ((fd + (double) g) / 2 == d) {
+            bool ok;
+            return slow_path(p, end, true, &ok);
+        }
+    }
+    return f;
+}
+
+static void
+decode_float(const char * p, const char * end, token_t * t)
+{
+    const char * start = p;
+    uint64_t w = 0;
+    int ndigits = 0;
+    long exp10 = 0;
+    bool truncated = false;
+    bool ok = true;
+    double d;
+    t->typ = TOK_LITERAL_FLOAT;
+
+    if (end[-1] == 'f' || end[-1] == 'F') {
+        t->flags |= TF_NUM_F;
+        end--;
+    } else if (end[-1] == 'l' || end[-1] == 'L') {
+        // long double literals keep a double value
+        t->flags |= TF_NUM_L;
+        end--;
+    }
+
+    if (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+        // hex floats are rare enough to leave to the C library, which
+        // takes them without an exponent; C doesn't
+        bool has_exp = memchr(p, 'p', end - p) || memchr(p, 'P', end - p);
+        t->u.d = slow_path(p, end, t->flags & TF_NUM_F, &ok);
+        if (!ok || !has_exp)
+            t->flags |= TF_NUM_INVALID;
+        return;
+    }
+
+    while (p < end && *p == '0') {
+        p++;
+    }
+    for (int in_frac = 0; in_frac < 2; in_frac++) {
+        if (in_frac) {
+            if (p >= end || *p != '.')
+                break;
+            p++;
+            if (w == 0) {
+                while (p < end && *p == '0') {
+                    exp10--;
+                    p++;
+                }
+            }
+        }
+#if SWAR_DIGITS
+        while (ndigits + 8 <= MAX_SIG_DIGITS && end - p >= 8 && is_eight_digits(load8(p))) {
+            w = w*100000000 + eight_digits(load8(p));
+            ndigits += 8;
+            exp10 -= in_frac ? 8 : 0;
+            p += 8;
+        }
+#endif
+        for (; p < end && isdigit((unsigned char) *p); p++) {
+            if (ndigits < MAX_SIG_DIGITS) {
+                w = w*10 + (*p - '0');
+                ndigits++;
+                exp10 -= in_frac;
+            } else {
+                exp10 += !in_frac;
+                truncated |= (*p != '0');
+            }
+        }
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        bool neg = false;
+        long e = 0;
+        p++;
+        if (p < end && (*p == '+' || *p == '-')) {
+            neg = (*p == '-');
+            p++;
+        }
+        if (p >= end || !isdigit((unsigned char) *p))
+            ok = false;
+        for (; p < end && isdigit((unsigned char) *p); p++) {
+            if (e < 100000)
+                e = e*10 + (*p - '0');
+        }
+        exp10 += neg ? -e : e;
+    }
+    if (p != end)
+        ok = false;
+
+    if (!truncated && exp10 >= -22 && exp10 <= 22 && w <= (1ull << 53)) {
+        // Clinger: w and 10^|q| are both exact, so this rounds once
+        d = (double) w;
+        d = exp10 < 0 ? d / pow10_exact[-exp10] : d * pow10_exact[exp10];
+    } else {
+        // a truncated w is too small by less than one, so if w and w+1
+        // round the same way so does the literal
+        double d_up;
+        if (!eisel_lemire(w, exp10, &d) || (truncated && (!eisel_lemire(w+1, exp10, &d_up) || d_up != d))) {
+            bool slow_ok;
+            d = slow_path(start, end, false, &slow_ok);
+        }
+    }
+    if (ok && (t->flags & TF_NUM_F))
+        d = round_to_float(d, start, end);
+    t->u.d = d;
+    if (!ok)
+        t->flags |= TF_NUM_INVALID;
+}
+
+void
+numlit_decode(const char * p, const char * end, token_t * t)
+{
+    bool is_hex = (end - p >= 2 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X'));
+    bool is_float = false;
+    for (const char * s = p; s < end; s++) {
+        if (*s == '.' || (is_hex ? (*s == 'p' || *s == 'P') : (*s == 'e' || *s == 'E'))) {
+            is_float = true;
+            break;
+        }
+    }
+    t->flags &= ~TF_NUM_MASK;
+    if (is_float)
+        decode_float(p, end, t);
+    else
+        decode_int(p, end, t);
+}
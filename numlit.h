@@ -0,0 +1,18 @@
+#ifndef NUMLIT_H
+#define NUMLIT_H
+
+#include "tokenizer.h"
+
+// Build the tables numlit_decode() needs up front, for callers about to
+// decode on several threads. Otherwise they're built on first use.
+void    numlit_init();
+
+// Length of the pp-number at [p, end), or 0 if there isn't one.
+size_t  numlit_len(const char * p, const char * end);
+
+// Decode the pp-number [p, end) into t: sets typ to TOK_LITERAL_INT or
+// TOK_LITERAL_FLOAT, u.i or u.d to the value, and the TF_NUM_* flags for its
+// suffix and for overflow or malformed literals.
+void    numlit_decode(const char * p, const char * end, token_t * t);
+
+#endif /* NUMLIT_H */
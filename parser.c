@@ -1,7 +1,14 @@
 #include "parser.h"
 #include "tokenizer.h"
 #include "arena.h"
+#include "symtab.h"
+#include "srcloc.h"
+#include "strlit.h"
+#include "xref.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <assert.h>
@@ -24,7 +31,7 @@
     X(PARAM_LIST)   \
     X(STMT)         \
     X(STMT_LIST)    \
-    X(EXPR)
+    X(CALL)
 
 #define X(A) AST_ ## A,
 typedef enum {
@@ -37,12 +44,54 @@ typedef enum {
 struct ast_node_t {
     ast_node_type_t typ;
     char * s;
-    int line_num;
+    uint32_t loc;
+    uint64_t val;       // value of an integer constant expression
+    uint8_t ctype;      // its type (see CT_UNSIGNED), or 0 if it isn't one
+    uint64_t hash;      // of the subtree's structure, leaving out locations
     ast_node_t ** children;
     size_t num_children;
     size_t children_cap;
 };
 
+// Integer constant expressions are folded as they're parsed, with LP64
+// types: a constant's type is its size in bytes, ORed with CT_UNSIGNED.
+// A fully constant expression becomes one TOK_LITERAL_INT node. Signed
+// overflow, division by zero and out of range shifts aren't folded, and
+// are left for whatever checks the expression later.
+#define CT_UNSIGNED     0x10
+#define CT_SIZE(T)      ((T) & 0xf)
+
+enum {
+    CT_INT      = 4,
+    CT_UINT     = 4 | CT_UNSIGNED,
+    CT_LONG     = 8,
+    CT_ULONG    = 8 | CT_UNSIGNED,
+};
+
+// recognize.c compiles this file again with RECOGNIZE defined, for a syntax
+// check that builds nothing: node construction is compiled out and every
+// parse function returns &matched when it succeeds. The only field of it
+// anything reads is s, the name of an identifier just parsed; literals set
+// nothing on it, and the constant folding is compiled out too.
+#ifdef RECOGNIZE
+static ast_node_t matched;
+
+// the furthest token fetched, which is where a failed parse went wrong
+static tokenizer_state_t furthest;
+
+static token_t
+recognize_get_token()
+{
+    if (tok_state.token_idx > furthest.token_idx)
+        furthest = tok_state;
+    return get_token();
+}
+#define get_token recognize_get_token
+#define parse_external_decl recognize_external_decl
+#define xref_add(NAME, KIND, LOC) ((void) 0)
+#endif
+
+#ifndef RECOGNIZE
 #define X(A) [AST_ ## A] = #A,
 static const char * enum_strs[] = {
     X(EOF)
@@ -61,7 +110,11 @@ ast_print_depth(ast_node_t * ast, FILE * fp, int depth)
         fputs("  ", fp);
     }
 
-    fprintf(fp, "%d: ", ast->line_num);
+    // shared nodes, like types, have no location
+    if (ast->loc) {
+        srcpos_t pos = srcloc_decode(ast->loc);
+        fprintf(fp, "%s:%d:%d: ", pos.file, pos.line, pos.col);
+    }
     const char * enum_str = enum_strs[ast->typ];
     if (enum_str == NULL) {
         if (isprint(ast->typ))
@@ -71,6 +124,10 @@ ast_print_depth(ast_node_t * ast, FILE * fp, int depth)
     }
     if (ast->typ == (ast_node_type_t) TOK_IDENT) {
         fprintf(fp, " (%s)", ast->s);
+    } else if (ast->ctype & CT_UNSIGNED) {
+        fprintf(fp, " (%llu)", (unsigned long long) ast->val);
+    } else if (ast->ctype) {
+        fprintf(fp, " (%lld)", (long long) ast->val);
     }
     fprintf(fp, "\n");
     for (size_t i = 0; i < ast->num_children; i++) {
@@ -85,13 +142,135 @@ ast_print(ast_node_t * ast, FILE * fp)
     ast_print_depth(ast, fp, 0);
 }
 
+// node type named s, as ast_print() shows it, or -1
+int
+ast_typ_from_str(const char * s, size_t len)
+{
+    if (len == 1 && ispunct((unsigned char) s[0]))
+        return s[0];
+    for (size_t i = 0; i < sizeof(enum_strs)/sizeof(enum_strs[0]); i++) {
+        if (enum_strs[i] && strlen(enum_strs[i]) == len && memcmp(enum_strs[i], s, len) == 0)
+            return (int) i;
+    }
+    return -1;
+}
+
+int
+ast_typ(const ast_node_t * np)
+{
+    return np->typ;
+}
+
+// identifier or string literal, or NULL
+const char *
+ast_str(const ast_node_t * np)
+{
+    return np->s;
+}
+
+// 0 for shared nodes, like types
+uint32_t
+ast_loc(const ast_node_t * np)
+{
+    return np->loc;
+}
+
+size_t
+ast_num_children(const ast_node_t * np)
+{
+    return np->num_children;
+}
+
+ast_node_t *
+ast_child(const ast_node_t * np, size_t i)
+{
+    assert(i < np->num_children);
+    return np->children[i];
+}
+
+uint64_t
+ast_hash(const ast_node_t * np)
+{
+    return np->hash;
+}
+
+// Whether a and b are the same but for locations. Different hashes settle
+// it at once; equal ones are checked all the way down, unless the subtrees
+// are one and the same.
+bool
+ast_equal(const ast_node_t * a, const ast_node_t * b)
+{
+    if (a == b)
+        return true;
+    if (a->hash != b->hash ||
+        a->typ != b->typ ||
+        a->val != b->val ||
+        a->ctype != b->ctype ||
+        a->num_children != b->num_children)
+        return false;
+    if (a->typ == (ast_node_type_t) TOK_LITERAL_STRING ? strcmp(a->s, b->s) != 0 : a->s != b->s)
+        return false;
+    for (size_t i = 0; i < a->num_children; i++) {
+        if (!ast_equal(a->children[i], b->children[i]))
+            return false;
+    }
+    return true;
+}
+#endif
+
+// Each node's hash is worked out as it's built, from its type, what it holds
+// and its children's hashes in order, so equal subtrees hash the same
+// wherever they are.
+#define HASH_SEED 0x2545f4914f6cdd1dull
+
+// a step of MurmurHash3's 64-bit mixing
+static uint64_t
+hash_mix(uint64_t h, uint64_t v)
+{
+    v *= 0x87c37b91114253d5ull;
+    v = (v << 31) | (v >> 33);
+    v *= 0x4cf5ad432745937full;
+    h ^= v;
+    h = (h << 27) | (h >> 37);
+    return h*5 + 0x52dce729;
+}
+
+// FNV-1a
+static uint64_t
+hash_bytes(const char * s, size_t len)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) s[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+// Hash a node without children once it's filled in. extra is whatever else
+// tells apart leaves of its type: an interned name's pointer, a string
+// literal's bytes, a float's suffix.
+static void
+hash_leaf(ast_node_t * np, uint64_t extra)
+{
+#ifndef RECOGNIZE
+    uint64_t h = hash_mix(HASH_SEED, np->typ);
+    h = hash_mix(h, np->val);
+    h = hash_mix(h, np->ctype);
+    np->hash = hash_mix(h, extra);
+#endif
+}
+
 static void
 ast_node_init_type_cap(ast_node_t * np, ast_node_type_t typ, size_t cap)
 {
     //assert(cap > 0);
     np->typ = typ;
     np->s = NULL;
-    np->line_num = tok_state.line_num;
+    np->loc = token_loc(tok_state);
+    np->val = 0;
+    np->ctype = 0;
+    np->hash = hash_mix(HASH_SEED, typ);
     np->num_children = 0;
     np->children_cap = cap;
     np->children = NULL;
@@ -117,6 +296,7 @@ ast_node_init(ast_node_t * np)
 static void
 ast_node_append_child(ast_node_t * np, ast_node_t * cp)
 {
+#ifndef RECOGNIZE
     if (np->num_children >= np->children_cap) {
         if (np->children_cap == 0) {
             size_t cap = (np->children_cap = 2);
@@ -128,14 +308,147 @@ ast_node_append_child(ast_node_t * np, ast_node_t * cp)
         }
     }
     np->children[np->num_children++] = cp;
+    np->hash = hash_mix(np->hash, cp->hash);
+#endif
+}
+
+static ast_node_t *
+new_node(ast_node_type_t typ, uint32_t loc, size_t cap)
+{
+#ifdef RECOGNIZE
+    return &matched;
+#else
+    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
+    ast_node_init_type_cap(np, typ, cap);
+    np->loc = loc;
+    return np;
+#endif
+}
+
+// Types are hash-consed: parse_type() returns the one AST_TYPE node for
+// each combination of specifiers, qualifiers and pointers, so types compare
+// by pointer and a header full of 'const char *' holds one copy. The nodes
+// live in their own arena for the life of the process, are never modified,
+// and have no location, since they're shared between declarations. A
+// storage class belongs to a declaration rather than its type, so it isn't
+// part of the key; see parse_decl_type().
+typedef struct {
+    const char * name;      // typedef name, interned
+    uint16_t qual;          // of the base type: TOK_CONST etc., or 0
+    uint16_t sign;          // TOK_SIGNED, TOK_UNSIGNED or 0
+    uint16_t base;          // TOK_INT etc., or TOK_IDENT for a typedef name
+    uint16_t num_ptrs;
+    uint16_t ptr_qual;      // of the outermost pointer
+} type_key_t;
+
+typedef struct {
+    type_key_t key;
+    uint32_t hash;
+    ast_node_t * type;
+} type_slot_t;
+
+static type_slot_t * type_slots;
+static size_t num_type_slots;   // always a power of 2
+static size_t num_types;
+static arena_t type_arena;
+
+static uint32_t
+hash_type_key(const type_key_t * kp)
+{
+    uint64_t h = (uint64_t)(uintptr_t) kp->name;
+    h = h*31 + kp->qual;
+    h = h*31 + kp->sign;
+    h = h*31 + kp->base;
+    h = h*31 + kp->num_ptrs;
+    h = h*31 + kp->ptr_qual;
+    h *= 0x9e3779b97f4a7c15ull;
+    return (uint32_t)(h >> 32);
+}
+
+static bool
+type_key_eq(const type_key_t * a, const type_key_t * b)
+{
+    return a->name == b->name &&
+           a->qual == b->qual &&
+           a->sign == b->sign &&
+           a->base == b->base &&
+           a->num_ptrs == b->num_ptrs &&
+           a->ptr_qual == b->ptr_qual;
 }
 
 static void
-alloc_and_append_node(ast_node_t * np, ast_node_type_t typ)
+grow_types()
+{
+    size_t old_num_slots = num_type_slots;
+    type_slot_t * old_slots = type_slots;
+    num_type_slots = num_type_slots ? num_type_slots*2 : 256;
+    type_slots = calloc(num_type_slots, sizeof(*type_slots));
+    assert(type_slots);
+    for (size_t i = 0; i < old_num_slots; i++) {
+        if (!old_slots[i].type)
+            continue;
+        size_t j = old_slots[i].hash & (num_type_slots-1);
+        while (type_slots[j].type) {
+            j = (j+1) & (num_type_slots-1);
+        }
+        type_slots[j] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+static ast_node_t *
+new_type_child(ast_node_t * np, ast_node_type_t typ)
 {
-    ast_node_t * child_node = arena_alloc(&arena, sizeof(*child_node));
-    ast_node_init_type_cap(child_node, typ, 0);
-    ast_node_append_child(np, child_node);
+    ast_node_t * cp = arena_alloc(&type_arena, sizeof(*cp));
+    *cp = (ast_node_t) { .typ = typ };
+    np->children[np->num_children++] = cp;
+    return cp;
+}
+
+// the canonical type node for key
+static ast_node_t *
+intern_type(const type_key_t * kp)
+{
+    if (num_types*2 >= num_type_slots) {
+        if (!type_arena.base)
+            type_arena = arena_init(1<<16);
+        grow_types();
+    }
+    uint32_t h = hash_type_key(kp);
+    size_t i = h & (num_type_slots-1);
+    while (type_slots[i].type) {
+        if (type_slots[i].hash == h && type_key_eq(&type_slots[i].key, kp))
+            return type_slots[i].type;
+        i = (i+1) & (num_type_slots-1);
+    }
+
+    size_t cap = 4 + kp->num_ptrs;
+    ast_node_t * np = arena_alloc(&type_arena, sizeof(*np));
+    *np = (ast_node_t) {
+        .typ = AST_TYPE,
+        .children = arena_alloc(&type_arena, sizeof(*np->children)*cap),
+        .children_cap = cap,
+    };
+    if (kp->qual)
+        new_type_child(np, kp->qual);
+    if (kp->sign)
+        new_type_child(np, kp->sign);
+    new_type_child(np, kp->base)->s = (char *) kp->name;
+    for (int j = 0; j < kp->num_ptrs; j++) {
+        new_type_child(np, '*');
+    }
+    if (kp->ptr_qual)
+        new_type_child(np, kp->ptr_qual);
+    np->hash = hash_mix(HASH_SEED, AST_TYPE);
+    for (size_t j = 0; j < np->num_children; j++) {
+        ast_node_t * cp = np->children[j];
+        hash_leaf(cp, (uintptr_t) cp->s);
+        np->hash = hash_mix(np->hash, cp->hash);
+    }
+
+    type_slots[i] = (type_slot_t) { .key = *kp, .hash = h, .type = np };
+    num_types++;
+    return np;
 }
 
 // TODO: 'void *' is allowed even though 'void' is not
@@ -145,33 +458,18 @@ parse_type()
 {
     tokenizer_state_t saved_tok_state = tok_state;
 
-    bool seen_const = false;
-    bool seen_const_ptr = false;
-
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type(np, AST_TYPE);
-    np->line_num = saved_tok_state.line_num;
+    type_key_t key = { 0 };
 
     token_t t = get_token();
-    // TODO: do these belong here?
-    if (t.typ == TOK_AUTO       ||
-        t.typ == TOK_REGISTER   ||
-        t.typ == TOK_STATIC     ||
-        t.typ == TOK_EXTERN) {
-        alloc_and_append_node(np, t.typ);
-        t = get_token();
-    }
     if (t.typ == TOK_CONST      ||
         t.typ == TOK_VOLATILE   ||
         t.typ == TOK_RESTRICT) {
-        seen_const = true;
-        alloc_and_append_node(np, t.typ);
+        key.qual = t.typ;
         t = get_token();
     }
-    //  TODO: used-defined types
     if (t.typ == TOK_SIGNED ||
         t.typ == TOK_UNSIGNED) {
-        alloc_and_append_node(np, t.typ);
+        key.sign = t.typ;
         t = get_token();
     }
     if (t.typ == TOK_INT   ||
@@ -180,7 +478,14 @@ parse_type()
         t.typ == TOK_SHORT ||
         t.typ == TOK_FLOAT ||
         t.typ == TOK_DOUBLE) {
-        alloc_and_append_node(np, t.typ);
+        key.base = t.typ;
+        t = peek_token(0);
+    } else if (!key.sign &&
+               t.typ == TOK_IDENT &&
+               symtab_lookup(t.u.c_s) == SYM_TYPEDEF) {
+        // typedef name
+        key.base = TOK_IDENT;
+        key.name = t.u.c_s;
         t = peek_token(0);
     } else {
         goto no_match;
@@ -188,53 +493,92 @@ parse_type()
     if (t.typ == TOK_CONST      ||
         t.typ == TOK_VOLATILE   ||
         t.typ == TOK_RESTRICT) {
-        if (seen_const) {
+        if (key.qual) {
             // TODO: produce error
             goto no_match;
         }
-        alloc_and_append_node(np, t.typ);
+        // 'int const' is 'const int'
+        key.qual = t.typ;
+        get_token();
         t = peek_token(0);
     }
     if (t.typ == '*') {
         while (t.typ == '*') {
             get_token();
-            alloc_and_append_node(np, '*');
+            key.num_ptrs++;
             t = peek_token(0);
         }
         if (t.typ == TOK_CONST      ||
             t.typ == TOK_VOLATILE   ||
             t.typ == TOK_RESTRICT) {
-            if (seen_const_ptr) {
-                // TODO: produce error
-                goto no_match;
-            }
-            seen_const_ptr = true;
-            alloc_and_append_node(np, t.typ);
+            key.ptr_qual = t.typ;
             get_token();
         }
     }
-    return np;
+#ifdef RECOGNIZE
+    return &matched;
+#else
+    return intern_type(&key);
+#endif
 
 no_match:
     tok_state = saved_tok_state;
     return NULL;
 }
 
+// storage classes a declaration may start with where it is
+enum {
+    SC_AUTO     = 1 << 0,
+    SC_REGISTER = 1 << 1,
+    SC_STATIC   = 1 << 2,
+    SC_EXTERN   = 1 << 3,
+
+    SC_FILE     = SC_STATIC | SC_EXTERN,
+    SC_BLOCK    = SC_AUTO | SC_REGISTER | SC_STATIC | SC_EXTERN,
+    SC_PARAM    = SC_REGISTER,
+};
+
+// The type of a declaration, which may start with one of the storage
+// classes in allowed. That makes a node of its own, with the shared type as
+// its one child, so the same type with and without 'static' is still the
+// same node.
+static ast_node_t *
+parse_decl_type(int allowed)
+{
+    token_t t = peek_token(0);
+    int sc = t.typ == TOK_AUTO     ? SC_AUTO     :
+             t.typ == TOK_REGISTER ? SC_REGISTER :
+             t.typ == TOK_STATIC   ? SC_STATIC   :
+             t.typ == TOK_EXTERN   ? SC_EXTERN   : 0;
+    if (!sc)
+        return parse_type();
+    if (!(sc & allowed))
+        return NULL;
+    tokenizer_state_t saved_tok_state = tok_state;
+    get_token();
+    ast_node_t * type_node = parse_type();
+    if (!type_node) {
+        tok_state = saved_tok_state;
+        return NULL;
+    }
+    ast_node_t * np = new_node(t.typ, t.loc, 1);
+    ast_node_append_child(np, type_node);
+    return np;
+}
+
 static ast_node_t *
 parse_ident()
 {
     token_t t = get_token();
     if (t.typ == TOK_IDENT) {
-        ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-        ast_node_init_type_cap(np, t.typ, 0);
+        ast_node_t * np = new_node(t.typ, t.loc, 0);
         np->s = t.u.s;
-        np->line_num = tok_state.line_num;
+        hash_leaf(np, (uintptr_t) np->s);
         return np;
     }
     return NULL;
 }
 
-// TODO: arena checkpoint and restore to quickly discard unneeded allocations?
 static ast_node_t *
 parse_var_decl()
 {
@@ -247,13 +591,13 @@ parse_var_decl()
     if (!(type_node = parse_type()))    { goto no_match; }
     if (!(ident_node = parse_ident()))  { goto no_match; }
     if (get_token().typ != ';')         { goto no_match; }
+    symtab_define(ident_node->s, SYM_OBJECT);
+    xref_add(ident_node->s, XREF_VAR_DECL, ident_node->loc);
 
     // add children
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type_cap(np, AST_VAR_DECL, 2);
+    ast_node_t * np = new_node(AST_VAR_DECL, token_loc(saved_tok_state), 2);
     ast_node_append_child(np, type_node);
     ast_node_append_child(np, ident_node);
-    np->line_num = saved_tok_state.line_num;
     return np;
 
 no_match:
@@ -262,25 +606,25 @@ no_match:
 }
 
 static ast_node_t *
-parse_var_def()
+parse_var_def(int storage)
 {
     tokenizer_state_t saved_tok_state = tok_state;
 
     ast_node_t * type_node,
                * ident_node;
 
-    if (!(type_node = parse_type()))    { goto no_match; }
-    if (!(ident_node = parse_ident()))  { goto no_match; }
+    if (!(type_node = parse_decl_type(storage)))    { goto no_match; }
+    if (!(ident_node = parse_ident()))              { goto no_match; }
     // TODO: optional assignment
-    if (get_token().typ != ';')         { goto no_match; }
+    if (get_token().typ != ';')                     { goto no_match; }
+    symtab_define(ident_node->s, SYM_OBJECT);
+    xref_add(ident_node->s, XREF_VAR_DEF, ident_node->loc);
 
     // add children
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type_cap(np, AST_VAR_DEF, 3);
+    ast_node_t * np = new_node(AST_VAR_DEF, token_loc(saved_tok_state), 3);
     ast_node_append_child(np, type_node);
     ast_node_append_child(np, ident_node);
     // TODO: assignment
-    np->line_num = saved_tok_state.line_num;
     return np;
 
 no_match:
@@ -292,16 +636,15 @@ static ast_node_t *
 parse_param_list()
 {
     tokenizer_state_t saved_tok_state = tok_state;
+    size_t saved_sym_mark = symtab_mark();
 
     ast_node_t * type_node,
                * ident_node;
 
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type(np, AST_PARAM_LIST);
-    np->line_num = saved_tok_state.line_num;
+    ast_node_t * np = new_node(AST_PARAM_LIST, token_loc(saved_tok_state), 4);
 
     // zero parameters
-    if (peek_token(0).typ == ')') {
+    if (peek_typ(0) == ')') {
         return np;
     }
 
@@ -311,19 +654,22 @@ parse_param_list()
         if (!first && get_token().typ != ',')           { goto no_match; }
         first = false;
 
-        if (!(type_node = parse_type()))                { goto no_match; }
+        if (!(type_node = parse_decl_type(SC_PARAM)))   { goto no_match; }
         if (!(ident_node = parse_ident()))              { goto no_match; }
         ast_node_append_child(np, type_node);
         ast_node_append_child(np, ident_node);
+        symtab_define(ident_node->s, SYM_OBJECT);
+        xref_add(ident_node->s, XREF_PARAM, ident_node->loc);
 
         // n parameters
-        if (peek_token(0).typ == ')') {
+        if (peek_typ(0) == ')') {
             return np;
         }
     }
 
 no_match:
     tok_state = saved_tok_state;
+    symtab_rollback(saved_sym_mark);
     return NULL;
 }
 
@@ -331,109 +677,450 @@ static ast_node_t *
 parse_func_decl()
 {
     tokenizer_state_t saved_tok_state = tok_state;
+    size_t saved_sym_mark = symtab_mark();
 
     ast_node_t * type_node,
                * ident_node,
                * param_list_node;
 
-    if (!(type_node = parse_type()))                { goto no_match; }
+    if (!(type_node = parse_decl_type(SC_FILE)))    { goto no_match; }
     if (!(ident_node = parse_ident()))              { goto no_match; }
+    symtab_define(ident_node->s, SYM_OBJECT);
     if (get_token().typ != '(')                     { goto no_match; }
+    symtab_push_scope();
     if (!(param_list_node = parse_param_list()))    { goto no_match; }
     if (get_token().typ != ')')                     { goto no_match; }
     if (get_token().typ != ';')                     { goto no_match; }
+    symtab_pop_scope();
+    xref_add(ident_node->s, XREF_FUNC_DECL, ident_node->loc);
 
     // add children
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type_cap(np, AST_FUNC_DECL, 3);
+    ast_node_t * np = new_node(AST_FUNC_DECL, token_loc(saved_tok_state), 3);
     ast_node_append_child(np, type_node);
     ast_node_append_child(np, ident_node);
     ast_node_append_child(np, param_list_node);
-    np->line_num = saved_tok_state.line_num;
     return np;
 
 no_match:
     tok_state = saved_tok_state;
+    symtab_rollback(saved_sym_mark);
     return NULL;
 }
 
+static int
+promote(int t)
+{
+    return CT_SIZE(t) < 4 ? CT_INT : t;
+}
+
+// type of a binary operation on a and b
+static int
+usual_conv(int a, int b)
+{
+    a = promote(a);
+    b = promote(b);
+    if ((a & CT_UNSIGNED) == (b & CT_UNSIGNED))
+        return CT_SIZE(a) >= CT_SIZE(b) ? a : b;
+    int u = (a & CT_UNSIGNED) ? a : b;
+    int s = (a & CT_UNSIGNED) ? b : a;
+    return CT_SIZE(u) >= CT_SIZE(s) ? u : s;
+}
+
+// v converted to type t; signed values are kept sign-extended
+static uint64_t
+convert(uint64_t v, int t)
+{
+    int bits = CT_SIZE(t)*8;
+    if (bits == 64)
+        return v;
+    uint64_t m = ((uint64_t) 1 << bits) - 1;
+    v &= m;
+    if (!(t & CT_UNSIGNED) && (v >> (bits-1)))
+        v |= ~m;
+    return v;
+}
+
+static bool
+fits(int64_t v, int t)
+{
+    if (CT_SIZE(t) == 8)
+        return true;
+    int bits = CT_SIZE(t)*8;
+    return v >= -((int64_t) 1 << (bits-1)) && v < ((int64_t) 1 << (bits-1));
+}
+
+static bool
+fold_unary(int op, uint64_t x, int t, uint64_t * r, int * rt)
+{
+    t = promote(t);
+    *rt = t;
+    switch (op) {
+        case '+':   *r = x;                                 return true;
+        case '~':   *r = convert(~x, t);                    return true;
+        case '!':   *r = (x == 0);  *rt = CT_INT;           return true;
+        case '-':
+            if (t & CT_UNSIGNED) {
+                *r = convert(-x, t);
+                return true;
+            }
+            if ((int64_t) x == INT64_MIN || !fits(-(int64_t) x, t))
+                return false;
+            *r = -x;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool
+fold_binary(int op, uint64_t x, int tx, uint64_t y, int ty, uint64_t * r, int * rt)
+{
+    if (op == TOK_SH_LEFT || op == TOK_SH_RIGHT) {
+        int t = promote(tx);
+        int bits = CT_SIZE(t)*8;
+        int64_t n = (int64_t) convert(y, promote(ty));
+        if (!(promote(ty) & CT_UNSIGNED) && n < 0)
+            return false;
+        if ((uint64_t) n >= (uint64_t) bits)
+            return false;
+        *rt = t;
+        if (op == TOK_SH_RIGHT) {
+            // arithmetic for negative values, as gcc and clang do
+            *r = (t & CT_UNSIGNED) ? x >> n : (uint64_t) ((int64_t) x >> n);
+            return true;
+        }
+        if (!(t & CT_UNSIGNED) && ((int64_t) x < 0 || (int64_t) x > (INT64_MAX >> (64 - bits + n))))
+            return false;
+        *r = convert(x << n, t);
+        return true;
+    }
+    if (op == TOK_LOG_AND || op == TOK_LOG_OR) {
+        *rt = CT_INT;
+        *r = (op == TOK_LOG_AND) ? (x && y) : (x || y);
+        return true;
+    }
+
+    int t = usual_conv(tx, ty);
+    x = convert(x, t);
+    y = convert(y, t);
+    bool u = (t & CT_UNSIGNED) != 0;
+    int64_t sx = (int64_t) x, sy = (int64_t) y, sr;
+    *rt = t;
+    switch (op) {
+        case '<':       *r = u ? x <  y : sx <  sy;     *rt = CT_INT;   return true;
+        case '>':       *r = u ? x >  y : sx >  sy;     *rt = CT_INT;   return true;
+        case TOK_LTE:   *r = u ? x <= y : sx <= sy;     *rt = CT_INT;   return true;
+        case TOK_GTE:   *r = u ? x >= y : sx >= sy;     *rt = CT_INT;   return true;
+        case TOK_EQ:    *r = x == y;                    *rt = CT_INT;   return true;
+        case TOK_NE:    *r = x != y;                    *rt = CT_INT;   return true;
+        case '&':       *r = x & y;                     return true;
+        case '^':       *r = x ^ y;                     return true;
+        case '|':       *r = x | y;                     return true;
+        default: ;
+    }
+    if ((op == '/' || op == '%') && y == 0)
+        return false;
+    if (u) {
+        switch (op) {
+            case '+':   *r = convert(x + y, t);         return true;
+            case '-':   *r = convert(x - y, t);         return true;
+            case '*':   *r = convert(x * y, t);         return true;
+            case '/':   *r = x / y;                     return true;
+            case '%':   *r = x % y;                     return true;
+            default:    return false;
+        }
+    }
+    switch (op) {
+        case '+':
+            if (__builtin_add_overflow(sx, sy, &sr))
+                return false;
+            break;
+        case '-':
+            if (__builtin_sub_overflow(sx, sy, &sr))
+                return false;
+            break;
+        case '*':
+            if (__builtin_mul_overflow(sx, sy, &sr))
+                return false;
+            break;
+        case '/':
+        case '%':
+            if (sx == INT64_MIN && sy == -1)
+                return false;
+            sr = (op == '/') ? sx / sy : sx % sy;
+            break;
+        default:
+            return false;
+    }
+    if (!fits(sr, t))
+        return false;
+    *r = (uint64_t) sr;
+    return true;
+}
+
+// constant type a cast to type gives, or 0 if it isn't to an integer type
+static int
+type_ctype(ast_node_t * type)
+{
+    int size = 0;
+    bool is_unsigned = false;
+    for (size_t i = 0; i < type->num_children; i++) {
+        switch ((int) type->children[i]->typ) {
+            case '*':           return 0;
+            case TOK_FLOAT:     return 0;
+            case TOK_DOUBLE:    return 0;
+            case TOK_IDENT:     return 0;   // typedef name
+            case TOK_UNSIGNED:  is_unsigned = true;     break;
+            case TOK_CHAR:      size = 1;               break;
+            case TOK_SHORT:     size = 2;               break;
+            case TOK_INT:       size = 4;               break;
+            case TOK_LONG:      size = 8;               break;
+            default: ;
+        }
+    }
+    return size | (is_unsigned ? CT_UNSIGNED : 0);
+}
+
+// sizeof type, or 0 if it isn't known here
+static int
+type_size(ast_node_t * type)
+{
+    for (size_t i = 0; i < type->num_children; i++) {
+        switch ((int) type->children[i]->typ) {
+            case '*':           return 8;
+            case TOK_FLOAT:     return 4;
+            case TOK_DOUBLE:    return 8;
+            case TOK_IDENT:     return 0;
+            default: ;
+        }
+    }
+    return CT_SIZE(type_ctype(type));
+}
+
+// type of an integer literal, from its value, suffix and base
+static int
+int_literal_ctype(token_t t)
+{
+    if (t.flags & (TF_NUM_OVERFLOW | TF_NUM_INVALID))
+        return 0;
+    bool decimal = (t.flags & TF_NUM_DECIMAL) != 0;
+    bool u = (t.flags & TF_NUM_U) != 0;
+    if (!(t.flags & (TF_NUM_L | TF_NUM_LL))) {
+        if (!u && t.u.i <= INT32_MAX)
+            return CT_INT;
+        if ((u || !decimal) && t.u.i <= UINT32_MAX)
+            return CT_UINT;
+    }
+    if (!u && t.u.i <= INT64_MAX)
+        return CT_LONG;
+    return CT_ULONG;
+}
+
+// The node for a constant, in place of everything allocated since mark: the
+// subexpressions it was folded from are dropped.
 static ast_node_t *
-parse_expr()
+const_node(arena_mark_t mark, uint32_t loc, uint64_t val, int ctype)
+{
+#ifdef RECOGNIZE
+    return &matched;
+#else
+    arena_restore(&arena, mark);
+    ast_node_t * np = new_node(TOK_LITERAL_INT, loc, 0);
+    np->val = val;
+    np->ctype = (uint8_t) ctype;
+    hash_leaf(np, 0);
+    return np;
+#endif
+}
+
+static ast_node_t *
+unary_node(arena_mark_t mark, int op, uint32_t loc, ast_node_t * x)
+{
+#ifdef RECOGNIZE
+    return &matched;
+#else
+    uint64_t r;
+    int rt;
+    if (x->ctype && fold_unary(op, x->val, x->ctype, &r, &rt))
+        return const_node(mark, loc, r, rt);
+    ast_node_t * np = new_node(op, loc, 1);
+    ast_node_append_child(np, x);
+    return np;
+#endif
+}
+
+static ast_node_t *
+binary_node(arena_mark_t mark, int op, uint32_t loc, ast_node_t * x, ast_node_t * y)
+{
+#ifdef RECOGNIZE
+    return &matched;
+#else
+    uint64_t r;
+    int rt;
+    if (x->ctype && y->ctype && fold_binary(op, x->val, x->ctype, y->val, y->ctype, &r, &rt))
+        return const_node(mark, loc, r, rt);
+    ast_node_t * np = new_node(op, loc, 2);
+    ast_node_append_child(np, x);
+    ast_node_append_child(np, y);
+    return np;
+#endif
+}
+
+static ast_node_t * parse_expr();
+static ast_node_t * parse_assign_expr();
+static ast_node_t * parse_cast_expr();
+
+static ast_node_t *
+parse_primary_expr()
 {
     tokenizer_state_t saved_tok_state = tok_state;
+    arena_mark_t mark = arena_save(&arena);
 
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type(np, AST_EXPR);
-    np->line_num = saved_tok_state.line_num;
-
-    // () [] -> .                           left to right
-    // ! ~ ++ -- + - * & (type) sizeof      right to left
-    // * / %                                left to right
-    // + -                                  left to right
-    // << >>                                left to right
-    // < <= > >=                            left to right
-    // == !=                                left to right
-    // &                                    left to right
-    // ^                                    left to right
-    // |                                    left to right
-    // &&                                   left to right
-    // ||                                   left to right
-    // ?:                                   right to left
-    // = += -= *= /= %= &= ^= |= <<= >>=    right to left
-    // ,                                    left to right
-
-    //  j++;
-    //  a = 3;
-    //  b = 2*(a = 3);
-    //  b *= 2;
-    //  (x, y)
-    // terms:
-    //  literals
-    //  variables
-    //  function calls
-    //  ()s
-    // operators:
-    //  binary: + - * / % && || & | 
-    //  binary (lvalue required): += -= *= /= %= &= |=
-    //  unary: ! ~ - *
-    //  unary (lvalue required): & 
-    //  postfix (lvalue required): ++ --
-    //  struct: . ->
-    // other:
-    //  casts
-    //  sizeof()
+    ast_node_t * np;
+    token_t t = get_token();
+    switch (t.typ) {
+        case TOK_IDENT:
+            np = new_node(TOK_IDENT, t.loc, 0);
+            np->s = t.u.s;
+            hash_leaf(np, (uintptr_t) np->s);
+            xref_add(t.u.s, XREF_USE, t.loc);
+            return np;
+#ifdef RECOGNIZE
+        case TOK_LITERAL_INT:
+        case TOK_LITERAL_FLOAT:
+        case TOK_LITERAL_CHAR:
+            return &matched;
+#else
+        case TOK_LITERAL_INT:
+            np = new_node(TOK_LITERAL_INT, t.loc, 0);
+            np->val = t.u.i;
+            np->ctype = (uint8_t) int_literal_ctype(t);
+            hash_leaf(np, 0);
+            return np;
+        case TOK_LITERAL_FLOAT:
+            // the value is kept only to tell literals apart
+            np = new_node(TOK_LITERAL_FLOAT, t.loc, 0);
+            np->val = t.u.i;
+            hash_leaf(np, t.flags & TF_NUM_MASK);
+            return np;
+        case TOK_LITERAL_CHAR:
+        {
+            np = new_node(TOK_LITERAL_CHAR, t.loc, 0);
+            long long v = strlit_char_value(t);
+            switch (t.u.c_s[0]) {
+                case 'L':   np->ctype = CT_INT;                 break;
+                case 'u':   np->ctype = 2 | CT_UNSIGNED;        break;
+                case 'U':   np->ctype = CT_UINT;                break;
+                default:    np->ctype = CT_INT;                 break;
+            }
+            np->val = convert((uint64_t) v, np->ctype);
+            hash_leaf(np, 0);
+            return np;
+        }
+#endif
+        case TOK_LITERAL_STRING:
+        {
+            // adjacent literals are one string
+            int n = 1;
+            while (peek_typ(n-1) == TOK_LITERAL_STRING) {
+                n++;
+            }
+#ifdef RECOGNIZE
+            for (int i = 1; i < n; i++) {
+                get_token();
+            }
+            return &matched;
+#else
+            token_t * toks = arena_alloc(&arena, sizeof(*toks)*n);
+            toks[0] = t;
+            for (int i = 1; i < n; i++) {
+                toks[i] = get_token();
+            }
+            size_t len = strlit_concat(toks, n, NULL, 0);
+            char * s = arena_alloc_align(&arena, len+1, 1);
+            strlit_concat(toks, n, s, len);
+            s[len] = '\0';
+            np = new_node(TOK_LITERAL_STRING, t.loc, 0);
+            np->s = s;
+            // and the encoding prefix, if any
+            hash_leaf(np, hash_mix(hash_bytes(s, len), (unsigned char) t.u.c_s[0]));
+            return np;
+#endif
+        }
+        case '(':
+            if (!(np = parse_expr()))       { goto no_match; }
+            if (get_token().typ != ')')     { goto no_match; }
+            return np;
+        default:
+            goto no_match;
+    }
 
+no_match:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return NULL;
+}
+
+static ast_node_t *
+parse_postfix_expr()
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+
+    ast_node_t * np,
+               * sub_node;
+
+    if (!(np = parse_primary_expr()))       { goto no_match; }
     while (1) {
         token_t t = peek_token(0);
-        if (t.typ == ';' ||
-            t.typ == ')') {
-            return np;
-        }
-        t = get_token();
-        if (t.typ == '(') {
-            // either a cast or parenthetical expression
-            // try cast first
-            ast_node_t * cast_node = parse_type();
-            if (cast_node) {
-                t = get_token();
-                if (t.typ != ')') { goto no_match; }
-                cast_node->typ = AST_CAST;
-                ast_node_append_child(np, cast_node);
+        switch (t.typ) {
+            case '[':
+            {
+                get_token();
+                if (!(sub_node = parse_expr())) { goto no_match; }
+                if (get_token().typ != ']')     { goto no_match; }
+                ast_node_t * idx_node = new_node('[', t.loc, 2);
+                ast_node_append_child(idx_node, np);
+                ast_node_append_child(idx_node, sub_node);
+                np = idx_node;
+                break;
+            }
+            case '(':
+            {
+                get_token();
+                ast_node_t * call_node = new_node(AST_CALL, t.loc, 4);
+                ast_node_append_child(call_node, np);
+                for (int num_args = 0; peek_typ(0) != ')'; num_args++) {
+                    if (num_args > 0 && get_token().typ != ',')     { goto no_match; }
+                    if (!(sub_node = parse_assign_expr()))          { goto no_match; }
+                    ast_node_append_child(call_node, sub_node);
+                }
+                if (get_token().typ != ')')     { goto no_match; }
+                np = call_node;
+                break;
+            }
+            case '.':
+            case TOK_ARROW:
+            {
+                get_token();
+                if (!(sub_node = parse_ident()))    { goto no_match; }
+                ast_node_t * member_node = new_node(t.typ, t.loc, 2);
+                ast_node_append_child(member_node, np);
+                ast_node_append_child(member_node, sub_node);
+                np = member_node;
+                break;
             }
-            // must be a parenthetical expression
-            ast_node_t * paren_expr_node = parse_expr();
-            t = get_token();
-            if (t.typ == ')') {
-                ast_node_append_child(np, paren_expr_node);
+            case TOK_PRE_INCR:
+            case TOK_PRE_DEC:
+            {
+                get_token();
+                ast_node_t * post_node = new_node(t.typ == TOK_PRE_INCR ? TOK_POST_INCR : TOK_POST_DEC, t.loc, 1);
+                ast_node_append_child(post_node, np);
+                np = post_node;
+                break;
             }
+            default:
+                return np;
         }
-        //switch (t.typ) {
-        //    case '!': break;
-        //    case '~': break;
-        //    case '-': break;
-        //    case '*': break;
-        //    default: ;
-        //}
     }
 
 no_match:
@@ -441,24 +1128,274 @@ no_match:
     return NULL;
 }
 
+static ast_node_t *
+parse_unary_expr()
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+    arena_mark_t mark = arena_save(&arena);
+
+    ast_node_t * np,
+               * type_node;
+
+    token_t t = peek_token(0);
+    switch (t.typ) {
+        case TOK_PRE_INCR:
+        case TOK_PRE_DEC:
+            get_token();
+            if (!(np = parse_unary_expr()))     { goto no_match; }
+            return unary_node(mark, t.typ, t.loc, np);
+        case '&':
+        case '*':
+        case '+':
+        case '-':
+        case '~':
+        case '!':
+            get_token();
+            if (!(np = parse_cast_expr()))      { goto no_match; }
+            return unary_node(mark, t.typ, t.loc, np);
+        case TOK_SIZEOF:
+        {
+            get_token();
+            tokenizer_state_t operand_tok_state = tok_state;
+            if (get_token().typ == '(' && (type_node = parse_type()) && get_token().typ == ')') {
+#ifndef RECOGNIZE
+                int size = type_size(type_node);
+                if (size)
+                    return const_node(mark, t.loc, (uint64_t) size, CT_ULONG);
+#endif
+                np = new_node(TOK_SIZEOF, t.loc, 1);
+                ast_node_append_child(np, type_node);
+                return np;
+            }
+            tok_state = operand_tok_state;
+            if (!(np = parse_unary_expr()))     { goto no_match; }
+#ifndef RECOGNIZE
+            if (np->ctype)
+                return const_node(mark, t.loc, CT_SIZE(np->ctype), CT_ULONG);
+#endif
+            ast_node_t * sizeof_node = new_node(TOK_SIZEOF, t.loc, 1);
+            ast_node_append_child(sizeof_node, np);
+            return sizeof_node;
+        }
+        default:
+            return parse_postfix_expr();
+    }
+
+no_match:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return NULL;
+}
+
+static ast_node_t *
+parse_cast_expr()
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+    arena_mark_t mark = arena_save(&arena);
+
+    ast_node_t * type_node,
+               * operand_node;
+
+    token_t t = get_token();
+    if (t.typ != '(')                           { goto not_cast; }
+    if (!(type_node = parse_type()))            { goto not_cast; }
+    if (get_token().typ != ')')                 { goto not_cast; }
+    if (!(operand_node = parse_cast_expr()))    { goto no_match; }
+
+#ifndef RECOGNIZE
+    int ctype = type_ctype(type_node);
+    if (ctype && operand_node->ctype)
+        return const_node(mark, t.loc, convert(operand_node->val, ctype), ctype);
+#endif
+    ast_node_t * np = new_node(AST_CAST, t.loc, 2);
+    ast_node_append_child(np, type_node);
+    ast_node_append_child(np, operand_node);
+    return np;
+
+not_cast:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return parse_unary_expr();
+
+no_match:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return NULL;
+}
+
+// binding strength of a binary operator, or 0 if t isn't one
+static int
+binary_prec(int typ)
+{
+    switch (typ) {
+        case '*': case '/': case '%':                       return 10;
+        case '+': case '-':                                 return 9;
+        case TOK_SH_LEFT: case TOK_SH_RIGHT:                return 8;
+        case '<': case '>': case TOK_LTE: case TOK_GTE:     return 7;
+        case TOK_EQ: case TOK_NE:                           return 6;
+        case '&':                                           return 5;
+        case '^':                                           return 4;
+        case '|':                                           return 3;
+        case TOK_LOG_AND:                                   return 2;
+        case TOK_LOG_OR:                                    return 1;
+        default:                                            return 0;
+    }
+}
+
+// precedence climbing over the left associative binary operators
+static ast_node_t *
+parse_binary_expr(int min_prec)
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+    arena_mark_t mark = arena_save(&arena);
+
+    ast_node_t * np,
+               * rhs_node;
+
+    if (!(np = parse_cast_expr()))      { goto no_match; }
+    while (1) {
+        token_t t = peek_token(0);
+        int prec = binary_prec(t.typ);
+        if (prec == 0 || prec < min_prec)
+            return np;
+        get_token();
+        if (!(rhs_node = parse_binary_expr(prec + 1)))  { goto no_match; }
+        np = binary_node(mark, t.typ, t.loc, np, rhs_node);
+    }
+
+no_match:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return NULL;
+}
+
+static ast_node_t *
+parse_cond_expr()
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+    arena_mark_t mark = arena_save(&arena);
+
+    ast_node_t * cond_node,
+               * then_node,
+               * else_node;
+
+    if (!(cond_node = parse_binary_expr(1)))    { goto no_match; }
+    token_t t = peek_token(0);
+    if (t.typ != '?')
+        return cond_node;
+    get_token();
+    if (!(then_node = parse_expr()))            { goto no_match; }
+    if (get_token().typ != ':')                 { goto no_match; }
+    if (!(else_node = parse_cond_expr()))       { goto no_match; }
+
+#ifndef RECOGNIZE
+    if (cond_node->ctype && then_node->ctype && else_node->ctype) {
+        int ctype = usual_conv(then_node->ctype, else_node->ctype);
+        uint64_t val = cond_node->val ? then_node->val : else_node->val;
+        return const_node(mark, cond_node->loc, convert(val, ctype), ctype);
+    }
+#endif
+    ast_node_t * np = new_node('?', t.loc, 3);
+    ast_node_append_child(np, cond_node);
+    ast_node_append_child(np, then_node);
+    ast_node_append_child(np, else_node);
+    return np;
+
+no_match:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return NULL;
+}
+
+static bool
+is_assign_op(int typ)
+{
+    switch (typ) {
+        case '=':
+        case TOK_PLUS_EQ:
+        case TOK_MINUS_EQ:
+        case TOK_TIMES_EQ:
+        case TOK_DIV_EQ:
+        case TOK_MOD_EQ:
+        case TOK_AND_EQ:
+        case TOK_OR_EQ:
+        case TOK_XOR_EQ:
+        case TOK_SH_LEFT_EQ:
+        case TOK_SH_RIGHT_EQ:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// right associative, so recursion is enough
+static ast_node_t *
+parse_assign_expr()
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+
+    ast_node_t * np,
+               * rhs_node;
+
+    if (!(np = parse_cond_expr()))              { goto no_match; }
+    token_t t = peek_token(0);
+    if (!is_assign_op(t.typ))
+        return np;
+    get_token();
+    if (!(rhs_node = parse_assign_expr()))      { goto no_match; }
+    ast_node_t * assign_node = new_node(t.typ, t.loc, 2);
+    ast_node_append_child(assign_node, np);
+    ast_node_append_child(assign_node, rhs_node);
+    return assign_node;
+
+no_match:
+    tok_state = saved_tok_state;
+    return NULL;
+}
+
+static ast_node_t *
+parse_expr()
+{
+    tokenizer_state_t saved_tok_state = tok_state;
+    arena_mark_t mark = arena_save(&arena);
+
+    ast_node_t * np,
+               * rhs_node;
+
+    if (!(np = parse_assign_expr()))            { goto no_match; }
+    while (peek_typ(0) == ',') {
+        // never folded: a comma isn't allowed in a constant expression
+        token_t t = get_token();
+        if (!(rhs_node = parse_assign_expr()))  { goto no_match; }
+        np = binary_node(mark, ',', t.loc, np, rhs_node);
+    }
+    return np;
+
+no_match:
+    tok_state = saved_tok_state;
+    arena_restore(&arena, mark);
+    return NULL;
+}
+
 static ast_node_t *
 parse_stmt()
 {
     tokenizer_state_t saved_tok_state = tok_state;
+    size_t saved_sym_mark = symtab_mark();
 
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type(np, AST_STMT);
-    np->line_num = saved_tok_state.line_num;
+    ast_node_t * np = new_node(AST_STMT, token_loc(saved_tok_state), 4);
 
     token_t t = peek_token(0);
 
     // compound statement
     if (t.typ == '{') {
         get_token();
+        symtab_push_scope();
         ast_node_t * stmt_node;
         while (1) {
-            if (peek_token(0).typ == '}') {
+            if (peek_typ(0) == '}') {
                 get_token();
+                symtab_pop_scope();
                 return np;
             }
             if (!(stmt_node = parse_stmt()))    { goto no_match; }
@@ -468,21 +1405,22 @@ parse_stmt()
 
     // control statement
     switch (t.typ) {
+        // not supported yet, so a syntax error rather than something to
+        // try parsing as an expression
         case TOK_IF:
-            assert(0);
         case TOK_FOR:
-            assert(0);
         case TOK_WHILE:
-            assert(0);
         case TOK_DO:
-            assert(0);
         case TOK_SWITCH:
-            assert(0);
         case TOK_GOTO:
-            assert(0);
+            goto no_match;
         case TOK_RETURN:
         {
             get_token();
+            if (peek_typ(0) == ';') {
+                get_token();
+                return np;
+            }
             ast_node_t * expr_node = parse_expr();
             if (!expr_node)             { goto no_match; }
             if (get_token().typ != ';') { goto no_match; }
@@ -501,24 +1439,26 @@ parse_stmt()
 
 no_match:
     tok_state = saved_tok_state;
+    symtab_rollback(saved_sym_mark);
     return NULL;
 }
 
+// NOTE: no scope is pushed here; the outermost block of a function shares the
+// scope of its parameters, which parse_func_def() opens
 static ast_node_t *
 parse_func_body()
 {
     tokenizer_state_t saved_tok_state = tok_state;
+    size_t saved_sym_mark = symtab_mark();
 
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type(np, AST_STMT_LIST);
-    np->line_num = saved_tok_state.line_num;
+    ast_node_t * np = new_node(AST_STMT_LIST, token_loc(saved_tok_state), 4);
 
     while (1) {
-        if (peek_token(0).typ == '}') {
+        if (peek_typ(0) == '}') {
             return np;
         }
         ast_node_t * stmt_node;
-        if ((stmt_node = parse_var_def())) {
+        if ((stmt_node = parse_var_def(SC_BLOCK))) {
             ast_node_append_child(np, stmt_node);
             continue;
         }
@@ -531,6 +1471,7 @@ parse_func_body()
 
 no_match:
     tok_state = saved_tok_state;
+    symtab_rollback(saved_sym_mark);
     return NULL;
 }
 
@@ -538,33 +1479,37 @@ static ast_node_t *
 parse_func_def()
 {
     tokenizer_state_t saved_tok_state = tok_state;
+    size_t saved_sym_mark = symtab_mark();
 
     ast_node_t * type_node,
                * ident_node,
                * param_list_node,
                * func_body_node;
 
-    if (!(type_node = parse_type()))                { goto no_match; }
+    if (!(type_node = parse_decl_type(SC_FILE)))    { goto no_match; }
     if (!(ident_node = parse_ident()))              { goto no_match; }
+    symtab_define(ident_node->s, SYM_OBJECT);
     if (get_token().typ != '(')                     { goto no_match; }
+    symtab_push_scope();
     if (!(param_list_node = parse_param_list()))    { goto no_match; }
     if (get_token().typ != ')')                     { goto no_match; }
     if (get_token().typ != '{')                     { goto no_match; }
     if (!(func_body_node = parse_func_body()))      { goto no_match; }
     if (get_token().typ != '}')                     { goto no_match; }
+    symtab_pop_scope();
+    xref_add(ident_node->s, XREF_FUNC_DEF, ident_node->loc);
 
     // add children
-    ast_node_t * np = arena_alloc(&arena, sizeof(*np));
-    ast_node_init_type_cap(np, AST_FUNC_DEF, 4);
+    ast_node_t * np = new_node(AST_FUNC_DEF, token_loc(saved_tok_state), 4);
     ast_node_append_child(np, type_node);
     ast_node_append_child(np, ident_node);
     ast_node_append_child(np, param_list_node);
     ast_node_append_child(np, func_body_node);
-    np->line_num = saved_tok_state.line_num;
     return np;
 
 no_match:
     tok_state = saved_tok_state;
+    symtab_rollback(saved_sym_mark);
     return NULL;
 }
 
@@ -613,40 +1558,200 @@ no_match:
 static ast_node_t *
 parse_typedef()
 {
+    tokenizer_state_t saved_tok_state = tok_state;
+
+    ast_node_t * type_node,
+               * ident_node;
+
+    if (get_token().typ != TOK_TYPEDEF) { goto no_match; }
+    if (!(type_node = parse_type()))    { goto no_match; }
+    if (!(ident_node = parse_ident()))  { goto no_match; }
+    if (get_token().typ != ';')         { goto no_match; }
+    symtab_define(ident_node->s, SYM_TYPEDEF);
+    xref_add(ident_node->s, XREF_TYPEDEF, ident_node->loc);
+
+    // add children
+    ast_node_t * np = new_node(AST_TYPEDEF_DEF, token_loc(saved_tok_state), 2);
+    ast_node_append_child(np, type_node);
+    ast_node_append_child(np, ident_node);
+    return np;
+
 no_match:
+    tok_state = saved_tok_state;
     return NULL;
 }
 
+// one declaration or function definition at file scope
 ast_node_t *
-parse_tu()
+parse_external_decl()
 {
-    ast_node_t * ast = arena_alloc(&arena, sizeof(*ast));
-    ast_node_init_type(ast, AST_TU);
-    while (1) {
-        if (peek_token(0).typ == TOK_EOF) {
-            return ast;
+    ast_node_t * np;
+    // a failed alternative may have indexed parameters and uses
+    size_t saved_xref_mark = xref_mark();
+
+#define TRY(PARSE_CALL) \
+    if ((np = PARSE_CALL)) { \
+        return np; \
+    } else { \
+        xref_rollback(saved_xref_mark); \
+    }
+
+    TRY(parse_var_decl());
+    TRY(parse_var_def(SC_FILE));
+    TRY(parse_func_decl());
+    TRY(parse_func_def());
+    TRY(parse_struct_decl());
+    TRY(parse_struct_def());
+    TRY(parse_union_decl());
+    TRY(parse_union_def());
+    TRY(parse_enum_decl());
+    TRY(parse_enum_def());
+    TRY(parse_typedef());
+#undef TRY
+    return NULL;
+}
+
+#ifndef RECOGNIZE
+// Top-level declarations kept by ast_share_decl(), one of each, for the rest
+// of the process.
+typedef struct {
+    uint64_t hash;
+    ast_node_t * decl;
+} decl_slot_t;
+
+static decl_slot_t * decl_slots;
+static size_t num_decl_slots;   // always a power of 2
+static size_t num_decls;
+static arena_t decl_arena;
+
+static void
+grow_decls()
+{
+    size_t old_num_slots = num_decl_slots;
+    decl_slot_t * old_slots = decl_slots;
+    num_decl_slots = num_decl_slots ? num_decl_slots*2 : 1024;
+    decl_slots = calloc(num_decl_slots, sizeof(*decl_slots));
+    assert(decl_slots);
+    for (size_t i = 0; i < old_num_slots; i++) {
+        if (!old_slots[i].decl)
+            continue;
+        size_t j = old_slots[i].hash & (num_decl_slots-1);
+        while (decl_slots[j].decl) {
+            j = (j+1) & (num_decl_slots-1);
         }
-        ast_node_t * np;
+        decl_slots[j] = old_slots[i];
+    }
+    free(old_slots);
+}
+
+static ast_node_t *
+copy_tree(const ast_node_t * np)
+{
+    // types are shared already, and kept as long
+    if (np->typ == AST_TYPE)
+        return (ast_node_t *) np;
+    ast_node_t * cp = arena_alloc(&decl_arena, sizeof(*cp));
+    *cp = *np;
+    cp->children_cap = np->num_children;
+    cp->children = NULL;
+    if (np->num_children > 0)
+        cp->children = arena_alloc(&decl_arena, sizeof(*cp->children)*np->num_children);
+    for (size_t i = 0; i < np->num_children; i++) {
+        cp->children[i] = copy_tree(np->children[i]);
+    }
+    // other strings are interned
+    if (np->typ == (ast_node_type_t) TOK_LITERAL_STRING) {
+        size_t len = strlen(np->s);
+        cp->s = arena_alloc_align(&decl_arena, len+1, 1);
+        memcpy(cp->s, np->s, len+1);
+    }
+    return cp;
+}
 
-#define TRY(PARSE_FUNC) \
-        if ((np = PARSE_FUNC())) { \
-            ast_node_append_child(ast, np); \
-            continue; \
-        } else { \
+// The one copy of decl kept for the rest of the run, shared by every
+// declaration equal to it, so that the declarations of a header many files
+// include are kept once. *seen says whether an equal one was kept before
+// this. The copy has the locations of the first one, which stay good as
+// long as its file stays registered with srcloc.
+ast_node_t *
+ast_share_decl(ast_node_t * decl, bool * seen)
+{
+    if (num_decls*2 >= num_decl_slots) {
+        if (!decl_arena.base)
+            decl_arena = arena_init_vm((size_t) 1 << 36, 0);
+        grow_decls();
+    }
+    size_t i = decl->hash & (num_decl_slots-1);
+    while (decl_slots[i].decl) {
+        if (decl_slots[i].hash == decl->hash && ast_equal(decl_slots[i].decl, decl)) {
+            *seen = true;
+            return decl_slots[i].decl;
         }
+        i = (i+1) & (num_decl_slots-1);
+    }
+    decl_slots[i] = (decl_slot_t) { .hash = decl->hash, .decl = copy_tree(decl) };
+    num_decls++;
+    *seen = false;
+    return decl_slots[i].decl;
+}
+#endif
 
-        TRY(parse_var_decl);
-        TRY(parse_var_def);
-        TRY(parse_func_decl);
-        TRY(parse_func_def);
-        TRY(parse_struct_decl);
-        TRY(parse_struct_def);
-        TRY(parse_union_decl);
-        TRY(parse_union_def);
-        TRY(parse_enum_decl);
-        TRY(parse_enum_def);
-        TRY(parse_typedef);
-        break;
+#ifdef RECOGNIZE
+// Check that the token stream is a translation unit, allocating nothing. On
+// failure, *fail_loc is where the furthest token the parser fetched is.
+bool
+recognize_tu(uint32_t * fail_loc)
+{
+    furthest = tok_state;
+    while (peek_typ(0) != TOK_EOF) {
+        if (!parse_external_decl()) {
+            *fail_loc = token_loc(furthest);
+            return false;
+        }
     }
-    return NULL;
+    return true;
+}
+#else
+// Parse the token stream a top-level declaration at a time, passing each
+// one to fn. Unless fn returns true to keep it, the declaration is released
+// from the arena once fn returns, along with whatever fn allocated there.
+bool
+parse_tu_stream(parse_decl_fn fn, void * ctx)
+{
+    return parse_tu_window(fn, ctx, true) >= 0;
+}
+
+// As parse_tu_stream(), for one window of a longer stream: returns how many
+// tokens the declarations parsed took. Unless at_end, a declaration that
+// fails to parse may just be cut off by the window's end, so the tokens from
+// its start are left for the next window rather than failing.
+int
+parse_tu_window(parse_decl_fn fn, void * ctx, bool at_end)
+{
+    while (peek_typ(0) != TOK_EOF) {
+        arena_mark_t mark = arena_save(&arena);
+        ast_node_t * np = parse_external_decl();
+        if (!np) {
+            arena_restore(&arena, mark);
+            return at_end ? -1 : tok_state.token_idx;
+        }
+        if (!fn(np, ctx))
+            arena_restore(&arena, mark);
+    }
+    return tok_state.token_idx;
+}
+
+static bool
+append_decl(ast_node_t * decl, void * ctx)
+{
+    ast_node_append_child(ctx, decl);
+    return true;
 }
+
+ast_node_t *
+parse_tu()
+{
+    ast_node_t * ast = new_node(AST_TU, token_loc(tok_state), 4);
+    return parse_tu_stream(append_decl, ast) ? ast : NULL;
+}
+#endif
@@ -2,10 +2,28 @@
 #define PARSER_H
 
 #include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
 
 typedef struct ast_node_t ast_node_t;
 
 void ast_print(ast_node_t * ast, FILE * fp);
+int          ast_typ_from_str(const char * s, size_t len);
+int          ast_typ(const ast_node_t * np);
+const char * ast_str(const ast_node_t * np);
+uint32_t     ast_loc(const ast_node_t * np);
+size_t       ast_num_children(const ast_node_t * np);
+ast_node_t * ast_child(const ast_node_t * np, size_t i);
+uint64_t     ast_hash(const ast_node_t * np);
+bool         ast_equal(const ast_node_t * a, const ast_node_t * b);
+ast_node_t * ast_share_decl(ast_node_t * decl, bool * seen);
+// called with each top-level declaration; returns whether to keep it
+typedef bool (*parse_decl_fn)(ast_node_t * decl, void * ctx);
+
 ast_node_t * parse_tu();
+bool parse_tu_stream(parse_decl_fn fn, void * ctx);
+int parse_tu_window(parse_decl_fn fn, void * ctx, bool at_end);
+ast_node_t * parse_external_decl();
+bool recognize_tu(uint32_t * fail_loc);
 
 #endif /* PARSER_H */
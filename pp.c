@@ -0,0 +1,1532 @@
+#define _DEFAULT_SOURCE
+#include "pp.h"
+#include "tokenizer.h"
+#include "intern.h"
+#include "arena.h"
+#include "srcloc.h"
+#include "strlit.h"
+#include "ptrmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_INCLUDE_DEPTH   200
+#define MAX_COND_DEPTH      256
+#define MAX_EXPANSION_DEPTH 256
+#define MAX_MACRO_PARAMS    127
+
+typedef struct {
+    const char * path;      // interned
+    const char * dir;       // interned
+    const char * text;      // mapped read-only
+    size_t len;
+    uint32_t base;          // location of the first byte
+    token_t * toks;         // lexed when first included; only headers keep them
+    int num_toks;
+    const char * guard;     // controlling macro of an include guard, or NULL
+    dev_t dev;              // to tell whether the file has changed since
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+    unsigned checked;       // generation it was last compared with the disk
+} pp_file_t;
+
+typedef struct {
+    const char * name;
+    token_t * body;         // points into the defining file's token stream
+    int body_len;
+    const char ** params;   // interned; __VA_ARGS__ last if variadic
+    int num_params;
+    bool func_like;
+    bool variadic;
+    bool has_paste;         // body contains ## and can't be replayed as is
+    bool disabled;          // being expanded, so not eligible for expansion
+} macro_t;
+
+// A macro expansion in progress: a slice of tokens replayed in place, and
+// the macro to re-enable once it's used up. The bottom context of a reader
+// is whatever is being expanded: a file's token stream or a macro argument.
+typedef struct {
+    token_t * toks;
+    int num_toks;
+    int idx;
+    macro_t * macro;
+} pp_ctx_t;
+
+typedef struct {
+    pp_ctx_t ctx[MAX_EXPANSION_DEPTH];
+    int depth;
+} pp_reader_t;
+
+// growable token array in pp_arena
+typedef struct {
+    token_t * toks;
+    int num_toks;
+    int cap;
+} pp_buf_t;
+
+typedef struct {
+    bool was_active;        // the enclosing region is active
+    bool taken;             // one of the branches has been taken
+    bool seen_else;
+} cond_t;
+
+static ptrmap_t files;      // interned path -> pp_file_t
+static ptrmap_t resolved;   // interned (includer dir, header name) -> pp_file_t
+static ptrmap_t macros;     // interned name -> macro_t, reset for each TU
+
+static const char ** include_dirs;
+static int num_include_dirs;
+
+static arena_t pp_arena;    // per-TU allocations
+
+static pp_reader_t reader;  // expands macro invocations in files
+
+// output token stream, reused for each TU
+static token_t * out;
+static int num_out;
+static int out_cap;
+
+// When a run has a sink, the output is handed to it a window at a time.
+// Windows end at a top-level ';' or '}', so most hold whole declarations.
+#define PP_WINDOW (1 << 14)
+
+// The main file of a run with a sink is lexed a window of lines at a time
+// too, rather than whole. A window ends at a line start outside any
+// parentheses and not followed by a '(', so no macro invocation crosses it.
+#define PP_LEX_WINDOW (1 << 18)
+
+static pp_sink_fn sink;
+static void * sink_ctx;
+static bool sink_failed;
+static int out_depth;       // of brackets in the output so far
+static int flush_at;
+static token_t * window;    // of the main file, ending in TOK_EOF
+static int window_len;
+static size_t window_next;  // offset in its text of the next window
+
+static const char * str_if,
+                  * str_ifdef,
+                  * str_ifndef,
+                  * str_elif,
+                  * str_else,
+                  * str_endif,
+                  * str_include,
+                  * str_define,
+                  * str_undef,
+                  * str_error,
+                  * str_pragma,
+                  * str_line,
+                  * str_defined,
+                  * str_va_args;
+
+static void
+pp_error(uint32_t loc, const char * fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    srcpos_t pos = srcloc_decode(loc);
+    fprintf(stderr, "%s:%d:%d: error: ", pos.file, pos.line, pos.col);
+    vfprintf(stderr, fmt, ap);
+    fprintf(stderr, "\n");
+    va_end(ap);
+}
+
+static void
+buf_push(pp_buf_t * bp, token_t t)
+{
+    if (bp->num_toks >= bp->cap) {
+        size_t old_sz = sizeof(*bp->toks)*bp->cap;
+        bp->cap = bp->cap ? bp->cap*2 : 16;
+        bp->toks = arena_realloc_align(&pp_arena, bp->toks, old_sz, sizeof(*bp->toks)*bp->cap, 8);
+    }
+    bp->toks[bp->num_toks++] = t;
+}
+
+static void
+push_out(token_t t)
+{
+    if (num_out >= out_cap) {
+        out_cap = out_cap ? out_cap*2 : 4096;
+        out = realloc(out, sizeof(*out)*out_cap);
+        assert(out);
+    }
+    out[num_out++] = t;
+}
+
+// Point the tokenizer at the output, with an end of file token after it,
+// and keep what the sink didn't take for the next window. A window the sink
+// can't make progress on is left to grow, so it's handed over again only
+// once it has doubled.
+static bool
+flush_out(bool at_end)
+{
+    push_out((token_t) { .typ = TOK_EOF });
+    tokenizer_set_tokens(out, num_out);
+    num_out--;
+    int n = sink(at_end, sink_ctx);
+    if (n < 0) {
+        // the rest of the run is still preprocessed, for its errors
+        sink_failed = true;
+        num_out = 0;
+        return false;
+    }
+    memmove(out, out + n, sizeof(*out)*(num_out - n));
+    num_out -= n;
+    flush_at = num_out*2 > PP_WINDOW ? num_out*2 : PP_WINDOW;
+    return true;
+}
+
+static void
+emit(token_t t)
+{
+    push_out(t);
+    if (!sink)
+        return;
+    if (sink_failed) {
+        num_out = 0;
+        return;
+    }
+    if (t.typ == '{' || t.typ == '(' || t.typ == '[')
+        out_depth++;
+    else if (t.typ == '}' || t.typ == ')' || t.typ == ']')
+        out_depth--;
+    if ((t.typ == ';' || t.typ == '}') && out_depth == 0 && num_out >= flush_at)
+        flush_out(false);
+}
+
+// name of the directive starting at t; 'if' and 'else' are lexed as keywords
+static const char *
+directive_name(token_t * t)
+{
+    switch (t->typ) {
+        case TOK_IF:    return str_if;
+        case TOK_ELSE:  return str_else;
+        case TOK_IDENT: return t->u.c_s;
+        default:        return NULL;
+    }
+}
+
+// Whether toks[i] is a '#' starting a directive line. A newline inside a
+// block comment doesn't start a line: the comment is one space by then.
+static bool
+starts_directive(const token_t * toks, int i)
+{
+    if (toks[i].typ != '#')
+        return false;
+    return i == 0 || (toks[i-1].typ == '\n' && !(toks[i-1].flags & TF_IN_COMMENT));
+}
+
+static bool
+is_if_directive(const char * name)
+{
+    return name == str_if || name == str_ifdef || name == str_ifndef;
+}
+
+// Recognize the multiple-include optimization pattern:
+//
+//     #ifndef X
+//     #define X
+//     ...
+//     #endif
+//
+// with nothing but whitespace and comments outside the #ifndef/#endif.
+static const char *
+detect_guard(token_t * toks)
+{
+    int i = 0;
+    while (toks[i].typ == '\n') {
+        i++;
+    }
+    if (!starts_directive(toks, i) ||
+        directive_name(&toks[i+1]) != str_ifndef ||
+        toks[i+2].typ != TOK_IDENT ||
+        toks[i+3].typ != '\n') {
+        return NULL;
+    }
+    const char * guard = toks[i+2].u.c_s;
+    i += 3;
+    while (toks[i].typ == '\n') {
+        i++;
+    }
+    if (!starts_directive(toks, i) ||
+        directive_name(&toks[i+1]) != str_define ||
+        toks[i+2].typ != TOK_IDENT ||
+        toks[i+2].u.c_s != guard) {
+        return NULL;
+    }
+    int depth = 1;
+    for (; toks[i].typ != TOK_EOF; i++) {
+        if (depth == 0) {
+            if (toks[i].typ != '\n')
+                return NULL;
+            continue;
+        }
+        if (!starts_directive(toks, i))
+            continue;
+        const char * name = directive_name(&toks[i+1]);
+        if (is_if_directive(name)) {
+            depth++;
+        } else if (name == str_endif) {
+            if (--depth == 0) {
+                while (toks[i+1].typ != '\n' && toks[i+1].typ != TOK_EOF) {
+                    i++;
+                }
+            }
+        } else if (depth == 1 && (name == str_else || name == str_elif)) {
+            return NULL;
+        }
+    }
+    return depth == 0 ? guard : NULL;
+}
+
+static unsigned generation;
+static size_t num_ranges;       // new location ranges taken for files
+
+// map path read-only, with what fstat() says about it
+static bool
+map_file(const char * path, const char ** text, struct stat * st)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+    if (fstat(fd, st) < 0 || !S_ISREG(st->st_mode)) {
+        close(fd);
+        return false;
+    }
+    *text = "";
+    if (st->st_size > 0) {
+        *text = mmap(NULL, st->st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (*text == MAP_FAILED) {
+            close(fd);
+            return false;
+        }
+    }
+    close(fd);
+    return true;
+}
+
+// note the state on disk of the file fp was just read from
+static void
+note_file(pp_file_t * fp, const struct stat * st)
+{
+    fp->toks = NULL;
+    fp->num_toks = 0;
+    fp->guard = NULL;
+    fp->dev = st->st_dev;
+    fp->ino = st->st_ino;
+    fp->size = st->st_size;
+    fp->mtime = st->st_mtim;
+    fp->checked = generation;
+}
+
+// The cached fp, read again if it has changed on disk since it was last
+// looked at, or NULL if it's gone. Only done once per generation, so a run
+// that never starts a new one makes no syscalls for files it has seen.
+static pp_file_t *
+revalidate(pp_file_t * fp)
+{
+    if (fp->checked == generation)
+        return fp;
+    fp->checked = generation;
+    struct stat st;
+    if (stat(fp->path, &st) == 0 && st.st_dev == fp->dev && st.st_ino == fp->ino &&
+        st.st_size == fp->size && st.st_mtim.tv_sec == fp->mtime.tv_sec &&
+        st.st_mtim.tv_nsec == fp->mtime.tv_nsec) {
+        return fp;
+    }
+    // Nothing from earlier runs refers to the old text or tokens any more.
+    // The file is read into the same pp_file_t, so cached resolutions
+    // pointing at it stay right, and keeps its locations if it fits.
+    if (fp->len > 0)
+        munmap((void *) fp->text, fp->len);
+    free(fp->toks);
+    const char * text;
+    if (!map_file(fp->path, &text, &st)) {
+        fp->text = "";
+        fp->len = 0;
+        fp->base = srcloc_replace(fp->base, fp->text, 0);
+        fp->toks = NULL;
+        fp->num_toks = 0;
+        fp->guard = NULL;
+        fp->size = -1;                  // read it if it comes back
+        fp->checked = generation - 1;   // and look again next time
+        return NULL;
+    }
+    fp->text = text;
+    fp->len = st.st_size;
+    uint32_t base = srcloc_replace(fp->base, text, fp->len);
+    if (base != fp->base)
+        num_ranges++;
+    fp->base = base;
+    note_file(fp, &st);
+    return fp;
+}
+
+static pp_file_t *
+load_file(const char * path)
+{
+    path = intern_cstr(path);
+    pp_file_t * fp = ptrmap_get(&files, path);
+    if (fp)
+        return revalidate(fp);
+
+    const char * text;
+    struct stat st;
+    if (!map_file(path, &text, &st))
+        return NULL;
+    fp = malloc(sizeof(*fp));
+    assert(fp);
+    const char * slash = strrchr(path, '/');
+    fp->path = path;
+    fp->dir = slash ? intern(path, (slash == path) ? 1 : slash - path) : intern_cstr(".");
+    fp->text = text;
+    fp->len = st.st_size;
+    fp->base = srcloc_add_file(path, text, fp->len);
+    num_ranges++;
+    note_file(fp, &st);
+    ptrmap_put(&files, path, fp);
+    return fp;
+}
+
+// lex the whole of fp's text, registered at fp->base
+static void
+lex_file(pp_file_t * fp)
+{
+    fp->num_toks = lex(fp->text, fp->len, fp->base, &fp->toks);
+    fp->guard = detect_guard(fp->toks);
+}
+
+// Index just past the last line end in toks[0, n) that a window can end
+// at, or 0 if there's none.
+static int
+window_cut(token_t * toks, int n)
+{
+    int cut = 0, pending = 0, depth = 0;
+    bool bol = true, directive = false;
+    for (int i = 0; i < n; i++) {
+        token_t t = toks[i];
+        // a newline in a comment doesn't end the line
+        if (t.typ == '\n' && (t.flags & TF_IN_COMMENT))
+            continue;
+        if (t.typ == '\n') {
+            if (depth == 0)
+                pending = i+1;
+            bol = true;
+            directive = false;
+            continue;
+        }
+        // a line end is only a cut once it's known what follows it
+        if (pending && t.typ != '(')
+            cut = pending;
+        pending = 0;
+        if (bol && t.typ == '#')
+            directive = true;
+        bol = false;
+        if (directive)
+            continue;
+        if (t.typ == '(')
+            depth++;
+        else if (t.typ == ')' && depth > 0)
+            depth--;
+    }
+    return cut;
+}
+
+// Lex the next window of fp, the main file of the run, or return false if
+// the last one has been. The first call always makes one, even if empty.
+static bool
+lex_window(pp_file_t * fp)
+{
+    if (window && window_next >= fp->len)
+        return false;
+    for (size_t min_len = PP_LEX_WINDOW; ; min_len *= 2) {
+        token_t * toks;
+        size_t to;
+        int n = lex_lines(fp->text, window_next, min_len, fp->len, fp->base, &toks, &to);
+        if (to < fp->len) {
+            int cut = window_cut(toks, n-1);
+            if (cut == 0) {
+                // nowhere in a window this big to end it; try a bigger one
+                free(toks);
+                continue;
+            }
+            to = toks[cut-1].loc - fp->base + 1;
+            toks[cut] = (token_t) { .typ = TOK_EOF, .loc = fp->base + (uint32_t) to };
+            n = cut+1;
+        }
+        free(window);
+        window = toks;
+        window_len = n;
+        window_next = to;
+        return true;
+    }
+}
+
+static pp_file_t *
+try_dir(const char * dir, const char * name, size_t name_len)
+{
+    char buf[4096];
+    if (name[0] == '/' || strcmp(dir, ".") == 0) {
+        snprintf(buf, sizeof(buf), "%.*s", (int) name_len, name);
+    } else {
+        snprintf(buf, sizeof(buf), "%s/%.*s", dir, (int) name_len, name);
+    }
+    return load_file(buf);
+}
+
+// Find the file named by a header name ("foo.h" or <foo.h>). Resolutions are
+// cached, so including an already-seen header costs no syscalls.
+static pp_file_t *
+resolve_include(const char * header_name, const char * cur_dir)
+{
+    char buf[4096];
+    size_t len = strlen(header_name);
+    bool angled = header_name[0] == '<';
+    const char * name = header_name + 1;
+    size_t name_len = len - 2;
+
+    const char * key;
+    if (angled) {
+        key = header_name;
+    } else {
+        snprintf(buf, sizeof(buf), "%s/%s", cur_dir, header_name);
+        key = intern_cstr(buf);
+    }
+    pp_file_t * fp = ptrmap_get(&resolved, key);
+    if (fp) {
+        if ((fp = revalidate(fp)))
+            return fp;
+        // the file it resolved to is gone, but it may be in another directory
+        ptrmap_put(&resolved, key, NULL);
+    }
+
+    if (!angled) {
+        fp = try_dir(cur_dir, name, name_len);
+    }
+    for (int i = 0; !fp && i < num_include_dirs; i++) {
+        fp = try_dir(include_dirs[i], name, name_len);
+    }
+    if (fp) {
+        ptrmap_put(&resolved, key, fp);
+    }
+    return fp;
+}
+
+static bool
+macro_defined(const char * name)
+{
+    return ptrmap_get(&macros, name) != NULL;
+}
+
+static int
+param_index(macro_t * mp, token_t t)
+{
+    if (t.typ != TOK_IDENT)
+        return -1;
+    for (int i = 0; i < mp->num_params; i++) {
+        if (mp->params[i] == t.u.c_s)
+            return i;
+    }
+    return -1;
+}
+
+// With copy, the body is copied, for a d that goes away before the macro.
+static bool
+do_define(uint32_t loc, token_t * d, int n, bool copy)
+{
+    if (n < 1 || d[0].typ != TOK_IDENT) {
+        pp_error(loc, "macro names must be identifiers");
+        return false;
+    }
+    macro_t * mp = arena_alloc(&pp_arena, sizeof(*mp));
+    *mp = (macro_t) { .name = d[0].u.c_s };
+    int i = 1;
+    if (n > 1 && d[1].typ == '(' && !(d[1].flags & TF_SPACE)) {
+        const char * params[MAX_MACRO_PARAMS];
+        mp->func_like = true;
+        for (i = 2; i < n && d[i].typ != ')'; i++) {
+            if (mp->num_params > 0) {
+                if (d[i].typ != ',')                { goto bad_params; }
+                i++;
+            }
+            if (i >= n)                             { goto bad_params; }
+            if (mp->variadic)                       { goto bad_params; }
+            if (mp->num_params >= MAX_MACRO_PARAMS) { goto bad_params; }
+            if (d[i].typ == TOK_ELLIPSIS) {
+                mp->variadic = true;
+                params[mp->num_params++] = str_va_args;
+            } else if (d[i].typ == TOK_IDENT) {
+                params[mp->num_params++] = d[i].u.c_s;
+            } else {
+                goto bad_params;
+            }
+        }
+        if (i >= n)                                 { goto bad_params; }
+        i++;
+        mp->params = arena_alloc_align(&pp_arena, sizeof(*mp->params)*(mp->num_params+1), 8);
+        memcpy(mp->params, params, sizeof(*mp->params)*mp->num_params);
+    }
+    mp->body = d + i;
+    mp->body_len = n - i;
+    if (copy && mp->body_len > 0) {
+        mp->body = arena_alloc_align(&pp_arena, sizeof(*d)*mp->body_len, 8);
+        memcpy(mp->body, d + i, sizeof(*d)*mp->body_len);
+    }
+    for (int j = 0; j < mp->body_len; j++) {
+        if (mp->body[j].typ == TOK_HASHHASH) {
+            if (j == 0 || j == mp->body_len-1) {
+                pp_error(loc, "'##' cannot appear at either end of a macro expansion");
+                return false;
+            }
+            mp->has_paste = true;
+        }
+        if (mp->func_like && mp->body[j].typ == '#' &&
+            (j == mp->body_len-1 || param_index(mp, mp->body[j+1]) < 0)) {
+            pp_error(loc, "'#' is not followed by a macro parameter");
+            return false;
+        }
+    }
+    ptrmap_put(&macros, mp->name, mp);
+    return true;
+
+bad_params:
+    pp_error(loc, "invalid macro parameter list");
+    return false;
+}
+
+static void
+reader_init(pp_reader_t * rp, token_t * toks, int num_toks, int idx)
+{
+    rp->ctx[0] = (pp_ctx_t) { .toks = toks, .num_toks = num_toks, .idx = idx };
+    rp->depth = 1;
+}
+
+// pop the contexts that are used up, re-enabling their macros
+static void
+reader_pop(pp_reader_t * rp)
+{
+    while (rp->depth > 1) {
+        pp_ctx_t * cp = &rp->ctx[rp->depth-1];
+        if (cp->idx < cp->num_toks)
+            return;
+        if (cp->macro)
+            cp->macro->disabled = false;
+        rp->depth--;
+    }
+}
+
+static token_t
+reader_next(pp_reader_t * rp)
+{
+    reader_pop(rp);
+    pp_ctx_t * cp = &rp->ctx[rp->depth-1];
+    if (cp->idx >= cp->num_toks)
+        return (token_t) { .typ = TOK_EOF };
+    token_t t = cp->toks[cp->idx++];
+    if (t.typ == TOK_IDENT && !(t.flags & TF_NOEXPAND)) {
+        // paint names of macros being expanded so they're never expanded
+        macro_t * mp = ptrmap_get(&macros, t.u.c_s);
+        if (mp && mp->disabled)
+            t.flags |= TF_NOEXPAND;
+    }
+    return t;
+}
+
+// next token of a macro invocation, which may span lines of the file
+static token_t
+reader_next_in_invocation(pp_reader_t * rp)
+{
+    token_t t;
+    do {
+        t = reader_next(rp);
+    } while (t.typ == '\n');
+    return t;
+}
+
+// look ahead, without consuming anything, for the '(' of an invocation
+static bool
+reader_peek_lparen(pp_reader_t * rp)
+{
+    for (int d = rp->depth-1; d >= 0; d--) {
+        pp_ctx_t * cp = &rp->ctx[d];
+        for (int i = cp->idx; i < cp->num_toks; i++) {
+            token_t t = cp->toks[i];
+            if (t.typ == '\n')
+                continue;
+            if (i > 0 && starts_directive(cp->toks, i))
+                return false;
+            return t.typ == '(';
+        }
+    }
+    return false;
+}
+
+static bool expand_tokens(uint32_t loc, pp_reader_t * rp, pp_buf_t * bp, bool one);
+
+static token_t
+stringize(token_t * toks, int n)
+{
+    char tmp[4096];
+    size_t len = 0, cap = 64;
+    char * s = malloc(cap);
+    assert(s);
+    s[len++] = '"';
+    for (int i = 0; i < n; i++) {
+        size_t tlen = token_spell(toks[i], tmp, sizeof(tmp));
+        char * sp = tmp;
+        if (tlen >= sizeof(tmp)) {
+            // too long for tmp, so spell it again in full
+            sp = malloc(tlen + 1);
+            assert(sp);
+            token_spell(toks[i], sp, tlen + 1);
+        }
+        bool quoted = (toks[i].typ == TOK_LITERAL_STRING || toks[i].typ == TOK_LITERAL_CHAR);
+        if (len + 2*tlen + 4 > cap) {
+            cap = 2*(len + 2*tlen + 4);
+            s = realloc(s, cap);
+            assert(s);
+        }
+        if (i > 0 && (toks[i].flags & TF_SPACE))
+            s[len++] = ' ';
+        for (size_t j = 0; j < tlen; j++) {
+            if (quoted && (sp[j] == '"' || sp[j] == '\\'))
+                s[len++] = '\\';
+            s[len++] = sp[j];
+        }
+        if (sp != tmp)
+            free(sp);
+    }
+    s[len++] = '"';
+    token_t t = { .typ = TOK_LITERAL_STRING, .u.c_s = intern(s, len) };
+    if (memchr(s, '\\', len))
+        t.flags |= TF_ESCAPE;
+    free(s);
+    return t;
+}
+
+// spell a and b together and lex them back into a single token
+static bool
+paste(token_t a, token_t b, token_t * result)
+{
+    char buf[8192];
+    size_t alen = token_spell(a, buf, sizeof(buf));
+    if (alen >= sizeof(buf))
+        return false;
+    size_t blen = token_spell(b, buf + alen, sizeof(buf) - alen);
+    if (alen + blen >= sizeof(buf))
+        return false;
+    token_t * toks;
+    int n = lex(buf, alen + blen, 0, &toks);
+    bool ok = (n == 2 && toks[0].typ != TOK_INVALID);
+    if (ok) {
+        *result = toks[0];
+        result->flags = (result->flags & ~TF_SPACE) | (a.flags & TF_SPACE);
+        result->loc = a.loc;
+        // literals point into buf, which is about to go
+        if (result->typ == TOK_LITERAL_STRING || result->typ == TOK_LITERAL_CHAR)
+            result->u.c_s = intern(result->u.c_s, strlit_raw_len(result->u.c_s));
+    }
+    free(toks);
+    return ok;
+}
+
+typedef struct {
+    token_t * toks;
+    int num_toks;
+    token_t * expanded;     // fully macro-expanded, computed on demand
+    int num_expanded;
+    bool is_expanded;
+} pp_arg_t;
+
+// Collect the arguments of an invocation of mp; the '(' has been consumed.
+static bool
+collect_args(uint32_t loc, pp_reader_t * rp, macro_t * mp, pp_arg_t * args)
+{
+    pp_buf_t cur = { 0 };
+    int num_args = 0;
+    int depth = 0;
+    while (1) {
+        token_t t = reader_next_in_invocation(rp);
+        if (t.typ == TOK_EOF) {
+            pp_error(loc, "unterminated argument list invoking macro \"%s\"", mp->name);
+            return false;
+        }
+        bool ends_arg = (depth == 0 && (t.typ == ')' || (t.typ == ',' &&
+                         !(mp->variadic && num_args == mp->num_params-1))));
+        if (ends_arg) {
+            if (num_args >= mp->num_params && !(mp->num_params == 0 && cur.num_toks == 0 && t.typ == ')')) {
+                pp_error(loc, "macro \"%s\" passed too many arguments", mp->name);
+                return false;
+            }
+            if (num_args < mp->num_params) {
+                args[num_args] = (pp_arg_t) { .toks = cur.toks, .num_toks = cur.num_toks };
+                num_args++;
+            }
+            cur = (pp_buf_t) { 0 };
+            if (t.typ == ')')
+                break;
+            continue;
+        }
+        if (t.typ == '(')
+            depth++;
+        else if (t.typ == ')')
+            depth--;
+        buf_push(&cur, t);
+    }
+    // a variadic macro may be invoked without the variable arguments
+    if (num_args == mp->num_params-1 && mp->variadic) {
+        args[num_args++] = (pp_arg_t) { 0 };
+    }
+    if (num_args != mp->num_params) {
+        pp_error(loc, "macro \"%s\" requires %d arguments, but only %d given",
+                 mp->name, mp->num_params, num_args);
+        return false;
+    }
+    return true;
+}
+
+static bool
+expand_arg(uint32_t loc, pp_arg_t * ap)
+{
+    if (ap->is_expanded)
+        return true;
+    pp_reader_t * rp = malloc(sizeof(*rp));
+    assert(rp);
+    pp_buf_t b = { 0 };
+    reader_init(rp, ap->toks, ap->num_toks, 0);
+    bool ok = expand_tokens(loc, rp, &b, false);
+    free(rp);
+    ap->expanded = b.toks;
+    ap->num_expanded = b.num_toks;
+    ap->is_expanded = true;
+    return ok;
+}
+
+// Substitute arguments into the body of mp, applying # and ##. args is NULL
+// for object-like macros.
+static bool
+substitute(uint32_t loc, macro_t * mp, pp_arg_t * args, pp_buf_t * bp)
+{
+    token_t * body = mp->body;
+    int n = mp->body_len;
+    bool placemarker = false;   // last element was an empty argument
+
+    for (int j = 0; j < n; j++) {
+        token_t t = body[j];
+        int k;
+        if (args && t.typ == '#' && j+1 < n) {
+            k = param_index(mp, body[j+1]);
+            token_t st = stringize(args[k].toks, args[k].num_toks);
+            st.flags = (st.flags & ~TF_SPACE) | (t.flags & TF_SPACE);
+            buf_push(bp, st);
+            placemarker = false;
+            j++;
+            continue;
+        }
+        if (t.typ == TOK_HASHHASH && j+1 < n) {
+            token_t * rhs = &body[j+1];
+            int rhs_len = 1;
+            if (args && (k = param_index(mp, body[j+1])) >= 0) {
+                rhs = args[k].toks;
+                rhs_len = args[k].num_toks;
+            }
+            j++;
+            if (rhs_len == 0)
+                continue;
+            int i = 0;
+            if (!placemarker) {
+                token_t * lhs = &bp->toks[bp->num_toks-1];
+                if (!paste(*lhs, rhs[0], lhs)) {
+                    pp_error(loc, "pasting does not give a valid preprocessing token");
+                    return false;
+                }
+                i = 1;
+            }
+            for (; i < rhs_len; i++) {
+                buf_push(bp, rhs[i]);
+            }
+            placemarker = false;
+            continue;
+        }
+        if (args && (k = param_index(mp, t)) >= 0) {
+            token_t * toks;
+            int num_toks;
+            if (j+1 < n && body[j+1].typ == TOK_HASHHASH) {
+                toks = args[k].toks;
+                num_toks = args[k].num_toks;
+            } else {
+                if (!expand_arg(loc, &args[k]))
+                    return false;
+                toks = args[k].expanded;
+                num_toks = args[k].num_expanded;
+            }
+            for (int i = 0; i < num_toks; i++) {
+                token_t at = toks[i];
+                if (i == 0)
+                    at.flags = (at.flags & ~TF_SPACE) | (t.flags & TF_SPACE);
+                buf_push(bp, at);
+            }
+            placemarker = (num_toks == 0);
+            continue;
+        }
+        buf_push(bp, t);
+        placemarker = false;
+    }
+    return true;
+}
+
+// If t names a macro that's eligible for expansion, push its replacement
+// list onto rp. Returns 1 if it did, 0 if t is not to be expanded and -1 on
+// error.
+static int
+maybe_expand(uint32_t loc, pp_reader_t * rp, token_t t)
+{
+    if (t.typ != TOK_IDENT || (t.flags & TF_NOEXPAND))
+        return 0;
+    macro_t * mp = ptrmap_get(&macros, t.u.c_s);
+    if (!mp || mp->disabled)
+        return 0;
+    if (mp->func_like && !reader_peek_lparen(rp))
+        return 0;
+    if (rp->depth >= MAX_EXPANSION_DEPTH) {
+        pp_error(loc, "macro expansion nested too deeply");
+        return -1;
+    }
+
+    token_t * toks = mp->body;
+    int num_toks = mp->body_len;
+    if (mp->func_like || mp->has_paste) {
+        pp_arg_t args_buf[MAX_MACRO_PARAMS];
+        pp_arg_t * args = NULL;
+        if (mp->func_like) {
+            reader_next_in_invocation(rp);
+            args = args_buf;
+            if (!collect_args(loc, rp, mp, args))
+                return -1;
+        }
+        pp_buf_t b = { 0 };
+        if (!substitute(loc, mp, args, &b))
+            return -1;
+        toks = b.toks;
+        num_toks = b.num_toks;
+        if (num_toks > 0) {
+            toks[0].flags = (toks[0].flags & ~TF_SPACE) | (t.flags & TF_SPACE);
+        }
+    }
+
+    // replay the replacement list in place; object-like macros without ##
+    // are replayed straight out of the defining file's token stream. A used
+    // up context is left on the stack so its macro stays disabled while the
+    // last token's expansion is rescanned.
+    rp->ctx[rp->depth++] = (pp_ctx_t) { .toks = toks, .num_toks = num_toks, .macro = mp };
+    mp->disabled = true;
+    return 1;
+}
+
+// Macro-expand tokens from rp into bp. If one is set, stop after the first
+// token of the bottom context and everything its expansion produces.
+static bool
+expand_tokens(uint32_t loc, pp_reader_t * rp, pp_buf_t * bp, bool one)
+{
+    do {
+        token_t t = reader_next(rp);
+        if (t.typ == TOK_EOF)
+            break;
+        int rc = maybe_expand(loc, rp, t);
+        if (rc < 0)
+            return false;
+        if (rc == 0)
+            buf_push(bp, t);
+        reader_pop(rp);
+    } while (!one || rp->depth > 1);
+    return true;
+}
+
+typedef struct {
+    uint32_t loc;
+    token_t * toks;
+    int num_toks;
+    int idx;
+    int unevaluated;        // inside the untaken operand of && || ?:
+    bool ok;
+} pp_expr_t;
+
+// In #if every integer acts as intmax_t or uintmax_t, here 64 bits. The
+// value is kept as its two's complement bits, so signed arithmetic that
+// overflows wraps instead of being undefined.
+typedef struct {
+    uint64_t v;
+    bool is_unsigned;
+} pp_value_t;
+
+static pp_value_t eval_expr(pp_expr_t * ep);
+
+static pp_value_t
+pp_signed(int64_t v)
+{
+    return (pp_value_t) { .v = (uint64_t) v };
+}
+
+static token_t
+expr_next(pp_expr_t * ep)
+{
+    if (ep->idx >= ep->num_toks)
+        return (token_t) { .typ = TOK_EOF };
+    return ep->toks[ep->idx++];
+}
+
+static token_type_t
+expr_peek(pp_expr_t * ep)
+{
+    return ep->idx < ep->num_toks ? ep->toks[ep->idx].typ : TOK_EOF;
+}
+
+static void
+expr_error(pp_expr_t * ep, const char * msg)
+{
+    if (ep->ok)
+        pp_error(ep->loc, "%s", msg);
+    ep->ok = false;
+}
+
+static pp_value_t
+eval_unary(pp_expr_t * ep)
+{
+    token_t t = expr_next(ep);
+    pp_value_t v;
+    switch ((int) t.typ) {
+        case '+':
+            return eval_unary(ep);
+        case '-':
+            v = eval_unary(ep);
+            v.v = 0 - v.v;
+            return v;
+        case '~':
+            v = eval_unary(ep);
+            v.v = ~v.v;
+            return v;
+        case '!':
+            return pp_signed(eval_unary(ep).v == 0);
+        case '(':
+            v = eval_expr(ep);
+            if (expr_next(ep).typ != ')')
+                expr_error(ep, "missing ')' in expression");
+            return v;
+        case TOK_LITERAL_INT:
+            if (t.flags & TF_NUM_INVALID)
+                expr_error(ep, "invalid integer constant in #if expression");
+            if (t.flags & TF_NUM_OVERFLOW)
+                expr_error(ep, "integer constant is too large");
+            // one too big for intmax_t can only be unsigned
+            v.v = (uint64_t) t.u.i;
+            v.is_unsigned = (t.flags & TF_NUM_U) || v.v > INT64_MAX;
+            return v;
+        case TOK_LITERAL_CHAR:
+            return pp_signed(strlit_char_value(t));
+        default:
+            // identifiers that are left after expansion, keywords included
+            if (t.typ >= TOK_IF && t.typ <= TOK_INLINE)
+                return pp_signed(0);
+            if (t.typ == TOK_IDENT || t.typ == TOK_SIZEOF)
+                return pp_signed(0);
+            expr_error(ep, "invalid token in #if expression");
+            return pp_signed(0);
+    }
+}
+
+static int
+binop_prec(int typ)
+{
+    switch (typ) {
+        case '*': case '/': case '%':               return 10;
+        case '+': case '-':                         return 9;
+        case TOK_SH_LEFT: case TOK_SH_RIGHT:        return 8;
+        case '<': case '>': case TOK_LTE: case TOK_GTE: return 7;
+        case TOK_EQ: case TOK_NE:                   return 6;
+        case '&':                                   return 5;
+        case '^':                                   return 4;
+        case '|':                                   return 3;
+        case TOK_LOG_AND:                           return 2;
+        case TOK_LOG_OR:                            return 1;
+        default:                                    return 0;
+    }
+}
+
+// signed division, where only a zero divisor is left to the caller
+static int64_t
+div_signed(int64_t a, int64_t b, bool rem)
+{
+    // INT64_MIN / -1 overflows, and traps on x86
+    if (b == -1)
+        return rem ? 0 : (int64_t) (0 - (uint64_t) a);
+    return rem ? a % b : a / b;
+}
+
+static pp_value_t
+eval_binary(pp_expr_t * ep, int min_prec)
+{
+    pp_value_t lhs = eval_unary(ep);
+    int prec;
+    while ((prec = binop_prec(expr_peek(ep))) >= min_prec && prec > 0) {
+        int op = expr_next(ep).typ;
+        bool skip = (op == TOK_LOG_AND && !lhs.v) || (op == TOK_LOG_OR && lhs.v);
+        ep->unevaluated += skip;
+        pp_value_t rhs = eval_binary(ep, prec+1);
+        ep->unevaluated -= skip;
+
+        // the usual arithmetic conversions, except for shifts, whose type
+        // is the left operand's
+        bool is_unsigned = lhs.is_unsigned || rhs.is_unsigned;
+        uint64_t a = lhs.v, b = rhs.v;
+        int64_t sa = (int64_t) a, sb = (int64_t) b;
+        switch (op) {
+            case '*':           lhs.v = a * b; break;
+            case '+':           lhs.v = a + b; break;
+            case '-':           lhs.v = a - b; break;
+            case '&':           lhs.v = a & b; break;
+            case '^':           lhs.v = a ^ b; break;
+            case '|':           lhs.v = a | b; break;
+            case TOK_SH_LEFT:   lhs.v = a << (b & 63); continue;
+            case TOK_SH_RIGHT:
+                lhs.v = lhs.is_unsigned ? a >> (b & 63) : (uint64_t) (sa >> (b & 63));
+                continue;
+            case '<':           lhs = pp_signed(is_unsigned ? a < b : sa < sb); continue;
+            case '>':           lhs = pp_signed(is_unsigned ? a > b : sa > sb); continue;
+            case TOK_LTE:       lhs = pp_signed(is_unsigned ? a <= b : sa <= sb); continue;
+            case TOK_GTE:       lhs = pp_signed(is_unsigned ? a >= b : sa >= sb); continue;
+            case TOK_EQ:        lhs = pp_signed(a == b); continue;
+            case TOK_NE:        lhs = pp_signed(a != b); continue;
+            case TOK_LOG_AND:   lhs = pp_signed(a && b); continue;
+            case TOK_LOG_OR:    lhs = pp_signed(a || b); continue;
+            case '/':
+            case '%':
+                if (b == 0) {
+                    if (!ep->unevaluated)
+                        expr_error(ep, "division by zero in #if");
+                    lhs.v = 0;
+                } else if (is_unsigned) {
+                    lhs.v = (op == '/') ? a / b : a % b;
+                } else {
+                    lhs.v = (uint64_t) div_signed(sa, sb, op == '%');
+                }
+                break;
+            default: assert(0);
+        }
+        lhs.is_unsigned = is_unsigned;
+    }
+    return lhs;
+}
+
+static pp_value_t
+eval_expr(pp_expr_t * ep)
+{
+    pp_value_t cond = eval_binary(ep, 1);
+    if (expr_peek(ep) != '?')
+        return cond;
+    expr_next(ep);
+    bool taken = cond.v != 0;
+    ep->unevaluated += !taken;
+    pp_value_t a = eval_expr(ep);
+    ep->unevaluated -= !taken;
+    if (expr_next(ep).typ != ':')
+        expr_error(ep, "expected ':' in expression");
+    ep->unevaluated += taken;
+    pp_value_t b = eval_expr(ep);
+    ep->unevaluated -= taken;
+    // converted to the type of a and b together
+    pp_value_t v = taken ? a : b;
+    v.is_unsigned = a.is_unsigned || b.is_unsigned;
+    return v;
+}
+
+// evaluate the controlling expression of #if or #elif
+static bool
+eval_if_expr(uint32_t loc, token_t * d, int n, bool * result)
+{
+    // 'defined' has to be handled before expansion
+    pp_buf_t b = { 0 };
+    for (int i = 0; i < n; i++) {
+        if (d[i].typ != TOK_IDENT || d[i].u.c_s != str_defined) {
+            buf_push(&b, d[i]);
+            continue;
+        }
+        bool paren = (i+1 < n && d[i+1].typ == '(');
+        int j = i + 1 + paren;
+        if (j >= n || d[j].typ != TOK_IDENT || (paren && (j+1 >= n || d[j+1].typ != ')'))) {
+            pp_error(loc, "operator \"defined\" requires an identifier");
+            return false;
+        }
+        buf_push(&b, (token_t) { .typ = TOK_LITERAL_INT, .u.i = macro_defined(d[j].u.c_s) });
+        i = j + paren;
+    }
+
+    pp_reader_t * rp = malloc(sizeof(*rp));
+    assert(rp);
+    pp_buf_t e = { 0 };
+    reader_init(rp, b.toks, b.num_toks, 0);
+    bool ok = expand_tokens(loc, rp, &e, false);
+    free(rp);
+    if (!ok)
+        return false;
+    if (e.num_toks == 0) {
+        pp_error(loc, "#if with no expression");
+        return false;
+    }
+
+    pp_expr_t ex = { .loc = loc, .toks = e.toks, .num_toks = e.num_toks, .ok = true };
+    *result = eval_expr(&ex).v != 0;
+    if (ex.ok && ex.idx < ex.num_toks)
+        expr_error(&ex, "missing binary operator in #if expression");
+    return ex.ok;
+}
+
+// eval_if_expr(), releasing what it allocates once it's done
+static bool
+eval_if(uint32_t loc, token_t * d, int n, bool * result)
+{
+    arena_mark_t mark = arena_save(&pp_arena);
+    bool ok = eval_if_expr(loc, d, n, result);
+    arena_restore(&pp_arena, mark);
+    return ok;
+}
+
+static bool pp_file(pp_file_t * fp, int depth);
+
+static bool
+do_include(pp_file_t * fp, uint32_t loc, token_t * d, int n, int depth)
+{
+    const char * header_name = NULL;
+    if (n == 1 && d[0].typ == TOK_LITERAL_STRING) {
+        header_name = intern(d[0].u.c_s, strlit_raw_len(d[0].u.c_s));
+    } else if (n > 0) {
+        // computed include
+        pp_reader_t * rp = malloc(sizeof(*rp));
+        assert(rp);
+        pp_buf_t e = { 0 };
+        reader_init(rp, d, n, 0);
+        bool ok = expand_tokens(loc, rp, &e, false);
+        free(rp);
+        if (!ok)
+            return false;
+        if (e.num_toks == 1 && e.toks[0].typ == TOK_LITERAL_STRING) {
+            header_name = intern(e.toks[0].u.c_s, strlit_raw_len(e.toks[0].u.c_s));
+        } else if (e.num_toks > 2 && e.toks[0].typ == '<' && e.toks[e.num_toks-1].typ == '>') {
+            char buf[4096];
+            size_t len = 0;
+            for (int i = 0; i < e.num_toks && len < sizeof(buf); i++) {
+                if (i > 0 && (e.toks[i].flags & TF_SPACE))
+                    buf[len++] = ' ';
+                if (len < sizeof(buf))
+                    len += token_spell(e.toks[i], buf + len, sizeof(buf) - len);
+            }
+            if (len < sizeof(buf))
+                header_name = intern(buf, len);
+        }
+    }
+    if (!header_name || header_name[0] == 'L' || header_name[0] == 'u' || header_name[0] == 'U') {
+        pp_error(loc, "expected \"FILENAME\" or <FILENAME>");
+        return false;
+    }
+    pp_file_t * inc = resolve_include(header_name, fp->dir);
+    if (!inc) {
+        pp_error(loc, "%s: cannot find include file", header_name);
+        return false;
+    }
+    if (inc->guard && macro_defined(inc->guard)) {
+        return true;
+    }
+    if (depth >= MAX_INCLUDE_DEPTH) {
+        pp_error(loc, "#include nested too deeply");
+        return false;
+    }
+    return pp_file(inc, depth+1);
+}
+
+static bool
+pp_file(pp_file_t * fp, int depth)
+{
+    cond_t conds[MAX_COND_DEPTH];
+    int num_conds = 0;
+    bool active = true;
+    // only the main file of a run with a sink is lexed a window at a time
+    bool windowed = sink && depth == 0;
+    if (windowed)
+        lex_window(fp);
+    else if (!fp->toks)
+        lex_file(fp);
+    token_t * toks = windowed ? window : fp->toks;
+    int num_toks = windowed ? window_len : fp->num_toks;
+
+    for (int i = 0; ; ) {
+        token_t t = toks[i];
+        uint32_t loc = t.loc;
+        if (t.typ == TOK_EOF) {
+            if (!windowed || !lex_window(fp))
+                break;
+            toks = window;
+            num_toks = window_len;
+            i = 0;
+            continue;
+        }
+        if (t.typ == '\n') {
+            i++;
+            continue;
+        }
+        if (!starts_directive(toks, i)) {
+            if (!active) {
+                i++;
+                continue;
+            }
+            if (t.typ != TOK_IDENT || !ptrmap_get(&macros, t.u.c_s)) {
+                emit(t);
+                i++;
+                continue;
+            }
+            // expand the macro invocation starting at i; nothing it
+            // allocates is needed once its result is emitted
+            arena_mark_t mark = arena_save(&pp_arena);
+            pp_buf_t result = { 0 };
+            reader_init(&reader, toks, num_toks, i);
+            if (!expand_tokens(loc, &reader, &result, true))
+                return false;
+            // the result of an expansion is located at the invocation
+            for (int j = 0; j < result.num_toks; j++) {
+                token_t et = result.toks[j];
+                et.loc = loc;
+                emit(et);
+            }
+            arena_restore(&pp_arena, mark);
+            i = reader.ctx[0].idx;
+            continue;
+        }
+
+        // directive
+        int end = i+1;
+        while (toks[end].typ != '\n' && toks[end].typ != TOK_EOF) {
+            end++;
+        }
+        if (end == i+1) {
+            i = end;
+            continue; // null directive
+        }
+        token_t * d = &toks[i+2];
+        int n = end - (i+2);
+        const char * name = directive_name(&toks[i+1]);
+        i = end;
+
+        if (is_if_directive(name)) {
+            if (num_conds >= MAX_COND_DEPTH) {
+                pp_error(loc, "conditionals nested too deeply");
+                return false;
+            }
+            cond_t * cp = &conds[num_conds++];
+            *cp = (cond_t) { .was_active = active };
+            if (!active)
+                continue;
+            if (name == str_if) {
+                if (!eval_if(loc, d, n, &cp->taken))
+                    return false;
+                active = cp->taken;
+                continue;
+            }
+            if (n < 1 || d[0].typ != TOK_IDENT) {
+                pp_error(loc, "macro names must be identifiers");
+                return false;
+            }
+            cp->taken = macro_defined(d[0].u.c_s) == (name == str_ifdef);
+            active = cp->taken;
+            continue;
+        }
+        if (name == str_elif || name == str_else || name == str_endif) {
+            if (num_conds == 0) {
+                pp_error(loc, "#%s without #if", name);
+                return false;
+            }
+            cond_t * cp = &conds[num_conds-1];
+            if (name == str_endif) {
+                active = cp->was_active;
+                num_conds--;
+                continue;
+            }
+            if (cp->seen_else) {
+                pp_error(loc, "#%s after #else", name);
+                return false;
+            }
+            if (name == str_else) {
+                cp->seen_else = true;
+                active = cp->was_active && !cp->taken;
+                cp->taken = true;
+                continue;
+            }
+            if (!cp->was_active || cp->taken) {
+                active = false;
+                continue;
+            }
+            if (!eval_if(loc, d, n, &cp->taken))
+                return false;
+            active = cp->taken;
+            continue;
+        }
+        if (!active)
+            continue;
+
+        if (name == str_include) {
+            if (!do_include(fp, loc, d, n, depth))
+                return false;
+        } else if (name == str_define) {
+            if (!do_define(loc, d, n, windowed))
+                return false;
+        } else if (name == str_undef) {
+            if (n < 1 || d[0].typ != TOK_IDENT) {
+                pp_error(loc, "macro names must be identifiers");
+                return false;
+            }
+            ptrmap_put(&macros, d[0].u.c_s, NULL);
+        } else if (name == str_error) {
+            pp_error(loc, "#error");
+            return false;
+        } else if (name == str_pragma || name == str_line) {
+            // ignored
+        } else {
+            pp_error(loc, "invalid preprocessing directive");
+            return false;
+        }
+    }
+
+    if (num_conds > 0) {
+        pp_error(toks[num_toks-1].loc, "unterminated conditional directive");
+        return false;
+    }
+    return true;
+}
+
+void
+pp_add_include_dir(const char * dir)
+{
+    include_dirs = realloc(include_dirs, sizeof(*include_dirs)*(num_include_dirs+1));
+    assert(include_dirs);
+    include_dirs[num_include_dirs++] = intern_cstr(dir);
+}
+
+// Preprocess the translation unit at path and point the tokenizer at the
+// result. Macros are per TU; files and include resolutions are kept.
+// A source given as text is copied, since its locations refer to it. When
+// no file took new locations after it, it's dropped at the start of the
+// next run, and its locations with it.
+static char * source_text;
+static uint32_t source_base;
+static size_t source_ranges;
+
+static void
+begin_run()
+{
+    if (!str_if) {
+        str_if      = intern_cstr("if");
+        str_ifdef   = intern_cstr("ifdef");
+        str_ifndef  = intern_cstr("ifndef");
+        str_elif    = intern_cstr("elif");
+        str_else    = intern_cstr("else");
+        str_endif   = intern_cstr("endif");
+        str_include = intern_cstr("include");
+        str_define  = intern_cstr("define");
+        str_undef   = intern_cstr("undef");
+        str_error   = intern_cstr("error");
+        str_pragma  = intern_cstr("pragma");
+        str_line    = intern_cstr("line");
+        str_defined = intern_cstr("defined");
+        str_va_args = intern_cstr("__VA_ARGS__");
+        pp_arena = arena_init(1<<16);
+    }
+    if (source_text && num_ranges == source_ranges) {
+        srcloc_release(source_base);
+        free(source_text);
+    }
+    source_text = NULL;
+    ptrmap_clear(&macros);
+    arena_reset(&pp_arena);
+    num_out = 0;
+    sink_failed = false;
+    out_depth = 0;
+    flush_at = PP_WINDOW;
+}
+
+static bool
+run(pp_file_t * fp)
+{
+    bool ok = pp_file(fp, 0);
+    // only headers keep their tokens from one run to the next
+    free(fp->toks);
+    fp->toks = NULL;
+    fp->num_toks = 0;
+    free(window);
+    window = NULL;
+    window_next = 0;
+    if (sink)
+        return ok && !sink_failed && flush_out(true);
+    push_out((token_t) { .typ = TOK_EOF });
+    tokenizer_set_tokens(out, num_out);
+    return ok;
+}
+
+bool
+pp_run(const char * path)
+{
+    begin_run();
+    pp_file_t * fp = load_file(path);
+    if (!fp) {
+        fprintf(stderr, "%s: cannot open file\n", path);
+        return false;
+    }
+    return run(fp);
+}
+
+// Preprocess path as pp_run() does, but hand the output to fn as it's
+// produced instead of holding all of it for the tokenizer.
+bool
+pp_run_stream(const char * path, pp_sink_fn fn, void * ctx)
+{
+    sink = fn;
+    sink_ctx = ctx;
+    bool ok = pp_run(path);
+    sink = NULL;
+    return ok;
+}
+
+// Preprocess text as if it were a file called name in the current
+// directory. Its tokens are only needed for this run, so they aren't kept.
+bool
+pp_run_source(const char * name, const char * text, size_t len)
+{
+    begin_run();
+    source_text = malloc(len + 1);
+    assert(source_text);
+    memcpy(source_text, text, len);
+    source_text[len] = '\0';
+
+    pp_file_t src = {
+        .path = intern_cstr(name),
+        .dir = intern_cstr("."),
+        .text = source_text,
+        .len = len,
+        .checked = generation,
+    };
+    src.base = source_base = srcloc_add_file(src.path, source_text, len);
+    source_ranges = num_ranges;
+    return run(&src);
+}
+
+// Files seen so far may have changed: compare each with the disk again the
+// next time it's included.
+void
+pp_revalidate()
+{
+    generation++;
+}
@@ -0,0 +1,24 @@
+#ifndef PP_H
+#define PP_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Preprocessor. Headers are mapped and lexed once and their token streams
+// are kept for the life of the process, so later translation units that
+// include them again skip straight to expansion. A long-lived caller calls
+// pp_revalidate() between runs to have changed files read again.
+
+void pp_add_include_dir(const char * dir);
+bool pp_run(const char * path);
+bool pp_run_source(const char * name, const char * text, size_t len);
+
+// Called with the tokenizer pointed at the next window of a streamed run's
+// output; returns how many of its tokens were used, or -1 to fail the run.
+// The rest are handed over again at the start of the next window. at_end
+// is set for the last window, which ends the stream.
+typedef int (*pp_sink_fn)(bool at_end, void * ctx);
+bool pp_run_stream(const char * path, pp_sink_fn fn, void * ctx);
+void pp_revalidate();
+
+#endif /* PP_H */
@@ -0,0 +1,77 @@
+#include "ptrmap.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+
+static size_t
+hash_ptr(const void * p)
+{
+    uint64_t h = (uint64_t)(uintptr_t) p * 0x9e3779b97f4a7c15ull;
+    return (size_t)(h >> 32);
+}
+
+// returns the slot holding key, or the empty slot where it would go
+static size_t
+find(const ptrmap_t * mp, const void * key)
+{
+    size_t i = hash_ptr(key) & (mp->num_slots-1);
+    while (mp->keys[i] && mp->keys[i] != key) {
+        i = (i+1) & (mp->num_slots-1);
+    }
+    return i;
+}
+
+void *
+ptrmap_get(const ptrmap_t * mp, const void * key)
+{
+    if (mp->num_slots == 0)
+        return NULL;
+    return mp->vals[find(mp, key)];
+}
+
+void
+ptrmap_put(ptrmap_t * mp, const void * key, void * val)
+{
+    assert(key);
+    if (mp->num_used*2 >= mp->num_slots) {
+        ptrmap_t old = *mp;
+        mp->num_slots = old.num_slots ? old.num_slots*2 : 256;
+        mp->keys = calloc(mp->num_slots, sizeof(*mp->keys));
+        mp->vals = calloc(mp->num_slots, sizeof(*mp->vals));
+        assert(mp->keys && mp->vals);
+        for (size_t i = 0; i < old.num_slots; i++) {
+            if (old.keys[i]) {
+                size_t j = find(mp, old.keys[i]);
+                mp->keys[j] = old.keys[i];
+                mp->vals[j] = old.vals[i];
+            }
+        }
+        free(old.keys);
+        free(old.vals);
+    }
+    size_t i = find(mp, key);
+    if (!mp->keys[i]) {
+        mp->keys[i] = key;
+        mp->num_used++;
+    }
+    mp->vals[i] = val;
+}
+
+void
+ptrmap_clear(ptrmap_t * mp)
+{
+    if (mp->num_slots) {
+        memset(mp->keys, 0, sizeof(*mp->keys)*mp->num_slots);
+        memset(mp->vals, 0, sizeof(*mp->vals)*mp->num_slots);
+    }
+    mp->num_used = 0;
+}
+
+void
+ptrmap_free(ptrmap_t * mp)
+{
+    free(mp->keys);
+    free(mp->vals);
+    *mp = (ptrmap_t) {0};
+}
@@ -0,0 +1,20 @@
+#ifndef PTRMAP_H
+#define PTRMAP_H
+
+#include <stddef.h>
+
+// Open addressing map keyed by pointer, usually an interned string. A zeroed
+// ptrmap_t is empty. A key put with a NULL value reads back as absent.
+typedef struct {
+    const void ** keys;
+    void ** vals;
+    size_t num_slots;       // always a power of 2
+    size_t num_used;
+} ptrmap_t;
+
+void *  ptrmap_get(const ptrmap_t * mp, const void * key);
+void    ptrmap_put(ptrmap_t * mp, const void * key, void * val);
+void    ptrmap_clear(ptrmap_t * mp);
+void    ptrmap_free(ptrmap_t * mp);
+
+#endif /* PTRMAP_H */
@@ -0,0 +1,188 @@
+#include "push.h"
+#include "parser.h"
+#include "tokenizer.h"
+#include "structidx.h"
+#include "srcloc.h"
+#include "arena.h"
+#include "xref.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+struct push_parser_t {
+    const char * name;
+    parse_decl_fn fn;
+    void * ctx;
+    structidx_scan_t * scan;
+    structidx_t ix;
+    bool in_body;           // see structidx_ends_decl()
+    char * text;            // text[start, len) is input not parsed yet
+    size_t start;
+    size_t len;
+    size_t cap;
+    size_t text_off;        // offset of text[start] in the input
+    int line;               // where text[start] is
+    int col;
+    bool bol;               // only whitespace before text[start] on its line
+    token_t * toks;         // of the last declaration parsed
+    bool keep_locs;
+    bool failed;
+};
+
+push_parser_t *
+push_parser_new(const char * name, parse_decl_fn fn, void * ctx)
+{
+    push_parser_t * ps = malloc(sizeof(*ps));
+    assert(ps);
+    *ps = (push_parser_t) {
+        .name = name,
+        .fn = fn,
+        .ctx = ctx,
+        .scan = structidx_scan_new(),
+        .line = 1,
+        .col = 1,
+        .bol = true,
+    };
+    return ps;
+}
+
+void
+push_parser_free(push_parser_t * ps)
+{
+    structidx_scan_free(ps->scan);
+    structidx_free(&ps->ix);
+    free(ps->text);
+    free(ps->toks);
+    free(ps);
+}
+
+void
+push_parser_keep_locs(push_parser_t * ps)
+{
+    ps->keep_locs = true;
+}
+
+// Lex and parse the next len bytes, which hold at most one declaration.
+static bool
+parse_piece(push_parser_t * ps, size_t len)
+{
+    const char * text = ps->text + ps->start;
+    uint32_t base = srcloc_add_piece(ps->name, text, len, ps->line, ps->col);
+    token_t * toks;
+    int n = lex(text, len, base, &toks);
+
+    // the parser doesn't want newlines or directives
+    bool bol = ps->bol;
+    int j = 0;
+    for (int i = 0; i < n; i++) {
+        // a newline in a comment doesn't start a line
+        if (toks[i].typ == '\n') {
+            if (!(toks[i].flags & TF_IN_COMMENT))
+                bol = true;
+            continue;
+        }
+        if (toks[i].typ == '#' && bol) {
+            while (toks[i+1].typ != '\n' && toks[i+1].typ != TOK_EOF) {
+                i++;
+            }
+            continue;
+        }
+        bol = false;
+        toks[j++] = toks[i];
+    }
+    free(ps->toks);
+    ps->toks = toks;
+    tokenizer_set_tokens(toks, j);
+    if (peek_typ(0) == TOK_EOF) {
+        srcloc_release(base);
+        return true;
+    }
+
+    arena_mark_t mark = arena_save(&arena);
+    size_t saved_xref_mark = xref_mark();
+    ast_node_t * np = parse_external_decl();
+    if (!np || peek_typ(0) != TOK_EOF) {
+        srcpos_t pos = srcloc_decode(token_loc(tok_state));
+        fprintf(stderr, "%s:%d:%d: parse error\n", pos.file, pos.line, pos.col);
+        arena_restore(&arena, mark);
+        srcloc_release(base);
+        return false;
+    }
+    // a declaration that isn't kept doesn't need its locations either, nor
+    // cross-references to them, unless they're being indexed
+    if (!ps->fn(np, ps->ctx)) {
+        arena_restore(&arena, mark);
+        if (!ps->keep_locs) {
+            xref_rollback(saved_xref_mark);
+            srcloc_release(base);
+        }
+    }
+    return true;
+}
+
+// move past the next len bytes, keeping track of where the rest starts
+static void
+consume(push_parser_t * ps, size_t len)
+{
+    for (size_t i = ps->start; i < ps->start + len; i++) {
+        char c = ps->text[i];
+        if (c == '\n') {
+            ps->line++;
+            ps->col = 1;
+            ps->bol = true;
+        } else {
+            ps->col++;
+            if (!strchr(" \t\r\f\v", c))
+                ps->bol = false;
+        }
+    }
+    ps->start += len;
+    ps->text_off += len;
+}
+
+bool
+push_parser_feed(push_parser_t * ps, const char * buf, size_t len)
+{
+    if (ps->failed)
+        return false;
+    // drop what has been parsed
+    memmove(ps->text, ps->text + ps->start, ps->len - ps->start);
+    ps->len -= ps->start;
+    ps->start = 0;
+    if (ps->len + len > ps->cap) {
+        while (ps->len + len > ps->cap) {
+            ps->cap = ps->cap ? ps->cap*2 : 1 << 16;
+        }
+        ps->text = realloc(ps->text, ps->cap);
+        assert(ps->text);
+    }
+    memcpy(ps->text + ps->len, buf, len);
+    ps->len += len;
+
+    ps->ix.num_pos = 0;
+    structidx_scan_feed(ps->scan, buf, len, &ps->ix);
+    for (size_t i = 0; i < ps->ix.num_pos; i++) {
+        struct_pos_t p = ps->ix.pos[i];
+        if (!structidx_ends_decl(p, &ps->in_body))
+            continue;
+        size_t end = p.off + 1 - ps->text_off;
+        if (!parse_piece(ps, end)) {
+            ps->failed = true;
+            return false;
+        }
+        consume(ps, end);
+    }
+    return true;
+}
+
+// parse whatever is left at the end of input
+bool
+push_parser_finish(push_parser_t * ps)
+{
+    if (ps->failed)
+        return false;
+    ps->failed = !parse_piece(ps, ps->len - ps->start);
+    consume(ps, ps->len - ps->start);
+    return !ps->failed;
+}
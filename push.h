@@ -0,0 +1,27 @@
+#ifndef PUSH_H
+#define PUSH_H
+
+#include "parser.h"
+#include <stddef.h>
+#include <stdbool.h>
+
+// Push-mode parsing, for input that arrives a piece at a time, like
+// preprocessed source on a pipe. The structural index finds where each
+// top-level declaration ends as the bytes come in, and a declaration is
+// lexed and parsed as soon as it's complete, so only the text of the one in
+// progress is kept. There's no preprocessing; directive lines, such as the
+// line markers cpp -E writes, are skipped.
+
+typedef struct push_parser_t push_parser_t;
+
+// fn is called with each declaration in order, which is released from the
+// arena afterwards unless fn keeps it, as with parse_tu_stream()
+push_parser_t * push_parser_new(const char * name, parse_decl_fn fn, void * ctx);
+void            push_parser_free(push_parser_t * ps);
+// keep the locations and cross-references of declarations fn doesn't keep,
+// for indexing a stream without holding on to its ASTs
+void            push_parser_keep_locs(push_parser_t * ps);
+bool            push_parser_feed(push_parser_t * ps, const char * buf, size_t len);
+bool            push_parser_finish(push_parser_t * ps);
+
+#endif /* PUSH_H */
@@ -0,0 +1,534 @@
+#include "query.h"
+#include "arena.h"
+#include "intern.h"
+#include "ptrmap.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <assert.h>
+
+#define MAX_ITEMS 64
+
+// what a node must be like to be in a state
+typedef struct {
+    int typ;                // or -1 for any
+    char cmp;               // '<', '=' or '>' to compare the number of
+    uint32_t count;         // children with count, or 0
+    const char * name;      // interned, or NULL
+    uint32_t * kids;        // states the leading children must be in
+    uint32_t num_kids;
+    uint32_t * has;         // states some child must be in
+    uint32_t num_has;
+    int first_query;        // list of the queries whose root this is, or -1
+} state_t;
+
+typedef struct {
+    uint32_t * states;
+    uint32_t num_states;
+} name_cands_t;
+
+// a query as written, kept for finding its captures once it matches
+typedef struct qpat_t qpat_t;
+struct qpat_t {
+    uint32_t state;
+    const char * capture;
+    qpat_t ** kids;
+    uint32_t num_kids;
+    qpat_t ** has;
+    uint32_t num_has;
+};
+
+struct query_set_t {
+    arena_t arena;          // patterns and the states' arrays
+    state_t * states;
+    size_t num_states;
+    size_t states_cap;
+    qpat_t ** queries;
+    int * next_query;       // next in its root state's list
+    int * num_captures;
+    int num_queries;
+    int queries_cap;
+    int max_captures;
+
+    // Candidate states for a node, built by compile(): those that want a
+    // name, by the name, so a node only tries the ones for its own; the
+    // rest by the node type they want, or for any node.
+    bool compiled;
+    ptrmap_t by_name;       // name -> name_cands_t in named
+    name_cands_t * named;
+    size_t num_named;
+    int max_typ;
+    uint32_t ** by_typ;
+    uint32_t * num_by_typ;
+    uint32_t * any;
+    uint32_t num_any;
+};
+
+query_set_t *
+query_set_new()
+{
+    query_set_t * qs = calloc(1, sizeof(*qs));
+    assert(qs);
+    qs->arena = arena_init(1<<16);
+    return qs;
+}
+
+static void
+free_tables(query_set_t * qs)
+{
+    for (int t = 0; t <= qs->max_typ && qs->by_typ; t++) {
+        free(qs->by_typ[t]);
+    }
+    free(qs->by_typ);
+    free(qs->num_by_typ);
+    free(qs->any);
+    for (size_t i = 0; i < qs->num_named; i++) {
+        free(qs->named[i].states);
+    }
+    free(qs->named);
+    ptrmap_free(&qs->by_name);
+    qs->named = NULL;
+    qs->num_named = 0;
+    qs->by_typ = NULL;
+    qs->num_by_typ = NULL;
+    qs->any = NULL;
+}
+
+void
+query_set_free(query_set_t * qs)
+{
+    free_tables(qs);
+    free(qs->states);
+    free(qs->queries);
+    free(qs->next_query);
+    free(qs->num_captures);
+    arena_deinit(&qs->arena);
+    free(qs);
+}
+
+static bool
+state_eq(const state_t * a, const state_t * b)
+{
+    return a->typ == b->typ &&
+           a->cmp == b->cmp &&
+           a->count == b->count &&
+           a->name == b->name &&
+           a->num_kids == b->num_kids &&
+           a->num_has == b->num_has &&
+           memcmp(a->kids, b->kids, sizeof(*a->kids)*a->num_kids) == 0 &&
+           memcmp(a->has, b->has, sizeof(*a->has)*a->num_has) == 0;
+}
+
+// The state for st, shared with any equal one already added. Sets are small
+// and only built once, so a linear search does.
+static uint32_t
+add_state(query_set_t * qs, const state_t * st)
+{
+    for (size_t i = 0; i < qs->num_states; i++) {
+        if (state_eq(&qs->states[i], st))
+            return (uint32_t) i;
+    }
+    if (qs->num_states >= qs->states_cap) {
+        qs->states_cap = qs->states_cap ? qs->states_cap*2 : 64;
+        qs->states = realloc(qs->states, sizeof(*qs->states)*qs->states_cap);
+        assert(qs->states);
+    }
+    state_t * sp = &qs->states[qs->num_states];
+    *sp = *st;
+    sp->kids = arena_alloc_align(&qs->arena, sizeof(*sp->kids)*st->num_kids, sizeof(uint32_t));
+    memcpy(sp->kids, st->kids, sizeof(*sp->kids)*st->num_kids);
+    sp->has = arena_alloc_align(&qs->arena, sizeof(*sp->has)*st->num_has, sizeof(uint32_t));
+    memcpy(sp->has, st->has, sizeof(*sp->has)*st->num_has);
+    sp->first_query = -1;
+    qs->compiled = false;
+    return (uint32_t) qs->num_states++;
+}
+
+typedef struct {
+    query_set_t * qs;
+    const char * p;
+    const char * err;
+    int num_captures;
+} qparse_t;
+
+static bool
+is_word_char(char c)
+{
+    return isalnum((unsigned char) c) || c == '_';
+}
+
+static void
+skip_space(qparse_t * pp)
+{
+    while (isspace((unsigned char) *pp->p)) {
+        pp->p++;
+    }
+}
+
+static bool
+at_word(qparse_t * pp, const char * w)
+{
+    size_t len = strlen(w);
+    return strncmp(pp->p, w, len) == 0 && !is_word_char(pp->p[len]);
+}
+
+static qpat_t **
+copy_pats(query_set_t * qs, qpat_t ** pats, uint32_t n)
+{
+    qpat_t ** copy = arena_alloc_align(&qs->arena, sizeof(*copy)*n, sizeof(void *));
+    memcpy(copy, pats, sizeof(*copy)*n);
+    return copy;
+}
+
+static qpat_t *
+parse_pattern(qparse_t * pp)
+{
+    query_set_t * qs = pp->qs;
+    state_t st = { .typ = -1 };
+    uint32_t kids[MAX_ITEMS], has[MAX_ITEMS];
+    qpat_t * kid_pats[MAX_ITEMS], * has_pats[MAX_ITEMS];
+    st.kids = kids;
+    st.has = has;
+
+    skip_space(pp);
+    if (at_word(pp, "_")) {
+        pp->p++;
+    } else if (*pp->p == '(') {
+        pp->p++;
+        skip_space(pp);
+        const char * w = pp->p;
+        if (at_word(pp, "_")) {
+            pp->p++;
+        } else if (is_word_char(*pp->p) || (ispunct((unsigned char) *pp->p) && !strchr("()\"#@", *pp->p))) {
+            if (is_word_char(*pp->p)) {
+                while (is_word_char(*pp->p)) {
+                    pp->p++;
+                }
+            } else {
+                pp->p++;
+            }
+            if ((st.typ = ast_typ_from_str(w, pp->p - w)) < 0) {
+                pp->p = w;
+                pp->err = "unknown node type";
+                return NULL;
+            }
+        } else {
+            pp->err = "expected a node type";
+            return NULL;
+        }
+
+        while (1) {
+            skip_space(pp);
+            if (*pp->p == ')') {
+                pp->p++;
+                break;
+            }
+            if (st.num_kids >= MAX_ITEMS || st.num_has >= MAX_ITEMS) {
+                pp->err = "too many items";
+                return NULL;
+            }
+            if (*pp->p == '#') {
+                pp->p++;
+                if (!*pp->p || !strchr("<=>", *pp->p) || !isdigit((unsigned char) pp->p[1])) {
+                    pp->err = "expected <, = or > and a number";
+                    return NULL;
+                }
+                st.cmp = *pp->p++;
+                st.count = (uint32_t) strtoul(pp->p, (char **) &pp->p, 10);
+            } else if (*pp->p == '"') {
+                const char * s = ++pp->p;
+                while (*pp->p && *pp->p != '"') {
+                    pp->p++;
+                }
+                if (!*pp->p) {
+                    pp->err = "unterminated name";
+                    return NULL;
+                }
+                st.name = intern(s, pp->p - s);
+                pp->p++;
+            } else if (at_word(pp, "has")) {
+                pp->p += 3;
+                qpat_t * sub = parse_pattern(pp);
+                if (!sub)
+                    return NULL;
+                has_pats[st.num_has] = sub;
+                has[st.num_has++] = sub->state;
+            } else {
+                qpat_t * sub = parse_pattern(pp);
+                if (!sub)
+                    return NULL;
+                kid_pats[st.num_kids] = sub;
+                kids[st.num_kids++] = sub->state;
+            }
+        }
+    } else {
+        pp->err = *pp->p ? "expected a pattern" : "unexpected end";
+        return NULL;
+    }
+
+    qpat_t * qp = arena_alloc(&qs->arena, sizeof(*qp));
+    *qp = (qpat_t) {
+        .state = add_state(qs, &st),
+        .kids = copy_pats(qs, kid_pats, st.num_kids),
+        .num_kids = st.num_kids,
+        .has = copy_pats(qs, has_pats, st.num_has),
+        .num_has = st.num_has,
+    };
+    skip_space(pp);
+    if (*pp->p == '@') {
+        const char * w = ++pp->p;
+        while (is_word_char(*pp->p)) {
+            pp->p++;
+        }
+        if (pp->p == w) {
+            pp->err = "expected a capture name";
+            return NULL;
+        }
+        qp->capture = intern(w, pp->p - w);
+        pp->num_captures++;
+    }
+    return qp;
+}
+
+// Add a query; its number is the count of queries added before it. On a
+// syntax error, says where, and returns false.
+bool
+query_add(query_set_t * qs, const char * src)
+{
+    qparse_t pp = { .qs = qs, .p = src };
+    qpat_t * qp = parse_pattern(&pp);
+    if (qp) {
+        skip_space(&pp);
+        if (*pp.p)
+            pp.err = "trailing text";
+    }
+    if (pp.err) {
+        fprintf(stderr, "query: %s at offset %d: %s\n", pp.err, (int)(pp.p - src), src);
+        return false;
+    }
+
+    if (qs->num_queries >= qs->queries_cap) {
+        qs->queries_cap = qs->queries_cap ? qs->queries_cap*2 : 16;
+        qs->queries = realloc(qs->queries, sizeof(*qs->queries)*qs->queries_cap);
+        qs->next_query = realloc(qs->next_query, sizeof(*qs->next_query)*qs->queries_cap);
+        qs->num_captures = realloc(qs->num_captures, sizeof(*qs->num_captures)*qs->queries_cap);
+        assert(qs->queries && qs->next_query && qs->num_captures);
+    }
+    qs->queries[qs->num_queries] = qp;
+    qs->num_captures[qs->num_queries] = pp.num_captures;
+    qs->num_queries++;
+    if (pp.num_captures > qs->max_captures)
+        qs->max_captures = pp.num_captures;
+    qs->compiled = false;
+    return true;
+}
+
+static void
+push_candidate(uint32_t ** list, uint32_t * n, uint32_t state)
+{
+    // lists are short; grow by powers of 2
+    if ((*n & (*n - 1)) == 0) {
+        *list = realloc(*list, sizeof(**list)*(*n ? *n*2 : 1));
+        assert(*list);
+    }
+    (*list)[(*n)++] = state;
+}
+
+// index the states as candidates for nodes, and each state's queries
+static void
+compile(query_set_t * qs)
+{
+    free_tables(qs);
+    qs->max_typ = 0;
+    size_t num_named = 0;
+    for (size_t i = 0; i < qs->num_states; i++) {
+        if (qs->states[i].typ > qs->max_typ)
+            qs->max_typ = qs->states[i].typ;
+        if (qs->states[i].name)
+            num_named++;
+        qs->states[i].first_query = -1;
+    }
+    if (num_named > 0) {
+        qs->named = calloc(num_named, sizeof(*qs->named));
+        assert(qs->named);
+    }
+    qs->by_typ = calloc(qs->max_typ + 1, sizeof(*qs->by_typ));
+    qs->num_by_typ = calloc(qs->max_typ + 1, sizeof(*qs->num_by_typ));
+    assert(qs->by_typ && qs->num_by_typ);
+    qs->num_any = 0;
+    for (size_t i = 0; i < qs->num_states; i++) {
+        int typ = qs->states[i].typ;
+        if (qs->states[i].name) {
+            name_cands_t * np = ptrmap_get(&qs->by_name, qs->states[i].name);
+            if (!np) {
+                np = &qs->named[qs->num_named++];
+                ptrmap_put(&qs->by_name, qs->states[i].name, np);
+            }
+            push_candidate(&np->states, &np->num_states, (uint32_t) i);
+        } else if (typ < 0)
+            push_candidate(&qs->any, &qs->num_any, (uint32_t) i);
+        else
+            push_candidate(&qs->by_typ[typ], &qs->num_by_typ[typ], (uint32_t) i);
+    }
+    // in reverse, so each list is in query order
+    for (int q = qs->num_queries-1; q >= 0; q--) {
+        state_t * sp = &qs->states[qs->queries[q]->state];
+        qs->next_query[q] = sp->first_query;
+        sp->first_query = q;
+    }
+    qs->compiled = true;
+}
+
+#define HAS_BIT(B, I)   (((B)[(I) / 64] >> ((I) % 64)) & 1)
+
+// the checks on np itself, not its children
+static bool
+node_matches(const state_t * sp, const ast_node_t * np)
+{
+    size_t n = ast_num_children(np);
+    if (sp->typ >= 0 && ast_typ(np) != sp->typ)
+        return false;
+    if ((sp->cmp == '<' && !(n < sp->count)) ||
+        (sp->cmp == '=' && !(n == sp->count)) ||
+        (sp->cmp == '>' && !(n > sp->count)))
+        return false;
+    if (sp->name && ast_str(np) != sp->name)
+        return false;
+    return n >= sp->num_kids;
+}
+
+// whether np is in state id, worked out from scratch rather than from its
+// children's states; only used to find captures
+static bool
+match_slow(const query_set_t * qs, uint32_t id, const ast_node_t * np)
+{
+    const state_t * sp = &qs->states[id];
+    if (!node_matches(sp, np))
+        return false;
+    for (uint32_t i = 0; i < sp->num_kids; i++) {
+        if (!match_slow(qs, sp->kids[i], ast_child(np, i)))
+            return false;
+    }
+    for (uint32_t j = 0; j < sp->num_has; j++) {
+        size_t i = 0;
+        while (i < ast_num_children(np) && !match_slow(qs, sp->has[j], ast_child(np, i))) {
+            i++;
+        }
+        if (i == ast_num_children(np))
+            return false;
+    }
+    return true;
+}
+
+typedef struct {
+    query_set_t * qs;
+    size_t words;           // per state set
+    query_match_fn fn;
+    void * ctx;
+    query_capture_t * caps;
+    int num_caps;
+} run_t;
+
+// np matches qp; note what it captures
+static void
+capture(run_t * rp, const qpat_t * qp, ast_node_t * np)
+{
+    if (qp->capture)
+        rp->caps[rp->num_caps++] = (query_capture_t) { .name = qp->capture, .node = np };
+    for (uint32_t i = 0; i < qp->num_kids; i++) {
+        capture(rp, qp->kids[i], ast_child(np, i));
+    }
+    for (uint32_t j = 0; j < qp->num_has; j++) {
+        for (size_t i = 0; i < ast_num_children(np); i++) {
+            if (match_slow(rp->qs, qp->has[j]->state, ast_child(np, i))) {
+                capture(rp, qp->has[j], ast_child(np, i));
+                break;
+            }
+        }
+    }
+}
+
+static void
+try_states(run_t * rp, const uint32_t * list, uint32_t n, ast_node_t * np,
+           const uint64_t * kid_bits, uint64_t * bits)
+{
+    query_set_t * qs = rp->qs;
+    size_t num_kids = ast_num_children(np);
+    for (uint32_t k = 0; k < n; k++) {
+        const state_t * sp = &qs->states[list[k]];
+        if (!node_matches(sp, np))
+            continue;
+        uint32_t i, j;
+        for (i = 0; i < sp->num_kids && HAS_BIT(kid_bits + i*rp->words, sp->kids[i]); i++)
+            ;
+        if (i < sp->num_kids)
+            continue;
+        for (j = 0; j < sp->num_has; j++) {
+            size_t c = 0;
+            while (c < num_kids && !HAS_BIT(kid_bits + c*rp->words, sp->has[j])) {
+                c++;
+            }
+            if (c == num_kids)
+                break;
+        }
+        if (j < sp->num_has)
+            continue;
+
+        bits[list[k] / 64] |= (uint64_t) 1 << (list[k] % 64);
+        for (int q = sp->first_query; q >= 0; q = qs->next_query[q]) {
+            rp->num_caps = 0;
+            if (qs->num_captures[q])
+                capture(rp, qs->queries[q], np);
+            rp->fn(q, np, rp->caps, rp->num_caps, rp->ctx);
+        }
+    }
+}
+
+// work out the states np is in, into bits, reporting matches on the way
+static void
+eval(run_t * rp, ast_node_t * np, uint64_t * bits)
+{
+    query_set_t * qs = rp->qs;
+    arena_mark_t mark = arena_save(&arena);
+    size_t n = ast_num_children(np);
+    uint64_t * kid_bits = NULL;
+    if (n > 0)
+        kid_bits = arena_alloc_align(&arena, sizeof(*kid_bits)*rp->words*n, sizeof(uint64_t));
+    for (size_t i = 0; i < n; i++) {
+        eval(rp, ast_child(np, i), kid_bits + i*rp->words);
+    }
+
+    memset(bits, 0, sizeof(*bits)*rp->words);
+    int typ = ast_typ(np);
+    if (typ <= qs->max_typ)
+        try_states(rp, qs->by_typ[typ], qs->num_by_typ[typ], np, kid_bits, bits);
+    try_states(rp, qs->any, qs->num_any, np, kid_bits, bits);
+    if (ast_str(np)) {
+        name_cands_t * cp = ptrmap_get(&qs->by_name, ast_str(np));
+        if (cp)
+            try_states(rp, cp->states, cp->num_states, np, kid_bits, bits);
+    }
+    arena_restore(&arena, mark);
+}
+
+// Run every query in qs over the tree at root, in one walk. The scratch
+// space it needs comes from the arena and is released before it returns.
+void
+query_run(query_set_t * qs, ast_node_t * root, query_match_fn fn, void * ctx)
+{
+    if (!qs->compiled)
+        compile(qs);
+    arena_mark_t mark = arena_save(&arena);
+    run_t r = {
+        .qs = qs,
+        .words = (qs->num_states + 63) / 64,
+        .fn = fn,
+        .ctx = ctx,
+        .caps = arena_alloc_align(&arena, sizeof(query_capture_t)*(qs->max_captures + 1), sizeof(void *)),
+    };
+    uint64_t * bits = arena_alloc_align(&arena, sizeof(*bits)*(r.words + 1), sizeof(uint64_t));
+    eval(&r, root, bits);
+    arena_restore(&arena, mark);
+}
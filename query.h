@@ -0,0 +1,47 @@
+#ifndef QUERY_H
+#define QUERY_H
+
+#include "parser.h"
+#include <stdbool.h>
+
+// Structural queries over the AST, written as S-expressions:
+//
+//   pattern := '_' capture?                    any node
+//            | '(' head item* ')' capture?
+//   head    := a node type as ast_print() shows it (FUNC_DEF, IDENT, *, ...)
+//            | '_'
+//   item    := pattern                         the next child matches it
+//            | 'has' pattern                   some child matches it
+//            | '#' ('<' | '=' | '>') NUMBER    number of children
+//            | '"' NAME '"'                    the node's identifier
+//   capture := '@' NAME
+//
+// Children not given a pattern can be anything, so
+//
+//   (FUNC_DEF _ (IDENT)@fn (PARAM_LIST #>12))
+//
+// finds functions with more than six parameters, and
+//
+//   (CAST (TYPE has (*)))
+//
+// casts to a pointer type. Every distinct subpattern of every query in a
+// set becomes one state of a bottom-up tree automaton, so one walk of the
+// tree works out which states each node is in and answers all the queries
+// at once.
+
+typedef struct query_set_t query_set_t;
+
+typedef struct {
+    const char * name;
+    ast_node_t * node;
+} query_capture_t;
+
+// called for each match, children's before their parents'
+typedef void (*query_match_fn)(int query, ast_node_t * np, const query_capture_t * caps, int num_caps, void * ctx);
+
+query_set_t *   query_set_new();
+void            query_set_free(query_set_t * qs);
+bool            query_add(query_set_t * qs, const char * src);
+void            query_run(query_set_t * qs, ast_node_t * root, query_match_fn fn, void * ctx);
+
+#endif /* QUERY_H */
@@ -0,0 +1,4 @@
+// The grammar of parser.c as a recognizer, which only checks syntax and
+// allocates nothing; see RECOGNIZE there.
+#define RECOGNIZE
+#include "parser.c"
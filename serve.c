@@ -0,0 +1,296 @@
+#define _DEFAULT_SOURCE
+#include "serve.h"
+#include "parser.h"
+#include "tokenizer.h"
+#include "symtab.h"
+#include "pp.h"
+#include "srcloc.h"
+#include "xref.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#define MAX_PAYLOAD 0xffffffffu
+#define MAX_REQUEST (1u << 28)
+
+// read exactly len bytes, returning how many there were before end of input
+static size_t
+read_full(int fd, void * buf, size_t len)
+{
+    size_t n = 0;
+    while (n < len) {
+        ssize_t r = read(fd, (char *) buf + n, len - n);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r <= 0)
+            break;
+        n += r;
+    }
+    return n;
+}
+
+static bool
+write_frame(int fd, int type, const char * payload, size_t len)
+{
+    unsigned char hdr[5] = {
+        type, (unsigned char) (len >> 24), (unsigned char) (len >> 16),
+        (unsigned char) (len >> 8), (unsigned char) len,
+    };
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = sizeof(hdr) },
+        { .iov_base = (void *) payload, .iov_len = len },
+    };
+    int i = 0;
+    while (i < 2) {
+        ssize_t r = writev(fd, iov + i, 2 - i);
+        if (r < 0 && errno == EINTR)
+            continue;
+        if (r < 0)
+            return false;
+        for (; i < 2 && (size_t) r >= iov[i].iov_len; i++) {
+            r -= iov[i].iov_len;
+        }
+        if (i < 2) {
+            iov[i].iov_base = (char *) iov[i].iov_base + r;
+            iov[i].iov_len -= r;
+        }
+    }
+    return true;
+}
+
+typedef enum {
+    FRAME_OK,
+    FRAME_END,          // end of input, or a short frame
+    FRAME_TOO_LONG,     // longer than the reader allows, or than memory does
+} frame_status_t;
+
+// Read the next frame into *buf, NUL-terminated and grown as needed. The
+// payload of a frame that's too long is left unread.
+static frame_status_t
+read_frame(int fd, size_t max, int * type, char ** buf, size_t * cap, size_t * len)
+{
+    unsigned char hdr[5];
+    if (read_full(fd, hdr, sizeof(hdr)) != sizeof(hdr))
+        return FRAME_END;
+    *type = hdr[0];
+    *len = (size_t) hdr[1] << 24 | (size_t) hdr[2] << 16 | (size_t) hdr[3] << 8 | hdr[4];
+    if (*len > max)
+        return FRAME_TOO_LONG;
+    if (*len + 1 > *cap) {
+        char * p = realloc(*buf, *len + 1);
+        if (!p)
+            return FRAME_TOO_LONG;
+        *buf = p;
+        *cap = *len + 1;
+    }
+    (*buf)[*len] = '\0';
+    return read_full(fd, *buf, *len) == *len ? FRAME_OK : FRAME_END;
+}
+
+// Preprocess and parse one request, printing the AST to out, or saying what
+// went wrong in err.
+static bool
+handle(int type, const char * payload, size_t len, bool check_only, FILE * out, char * err, size_t err_size)
+{
+    const char * name = type == 'f' ? payload : "<request>";
+    if (type != 'f' && type != 's') {
+        snprintf(err, err_size, "unknown request type %d", type);
+        return false;
+    }
+    if (!(type == 'f' ? pp_run(payload) : pp_run_source(name, payload, len))) {
+        snprintf(err, err_size, "%s: preprocessing failed", name);
+        return false;
+    }
+    if (check_only) {
+        uint32_t loc;
+        if (!recognize_tu(&loc)) {
+            srcpos_t pos = srcloc_decode(loc);
+            if (loc)
+                snprintf(err, err_size, "%s:%d:%d: syntax error", pos.file, pos.line, pos.col);
+            else
+                snprintf(err, err_size, "%s: syntax error at end of file", name);
+            return false;
+        }
+        return true;
+    }
+    ast_node_t * ast = parse_tu();
+    if (!ast) {
+        snprintf(err, err_size, "%s: parse error", name);
+        return false;
+    }
+    ast_print(ast, out);
+    return true;
+}
+
+// answer requests read from in on out until in ends
+static bool
+serve_conn(int in, int out, bool check_only)
+{
+    char * req = NULL;
+    size_t req_cap = 0, req_len;
+    int type;
+    bool ok = true;
+    frame_status_t st;
+    while (ok && (st = read_frame(in, MAX_REQUEST, &type, &req, &req_cap, &req_len)) != FRAME_END) {
+        // the rest of the frame can't be skipped without reading it all,
+        // so the connection ends here
+        if (st == FRAME_TOO_LONG) {
+            static const char msg[] = "request too long";
+            write_frame(out, 'e', msg, sizeof(msg) - 1);
+            ok = false;
+            break;
+        }
+        char * text;
+        size_t text_len;
+        char err[4096];
+        FILE * f = open_memstream(&text, &text_len);
+        assert(f);
+        size_t saved_xref_mark = xref_mark();
+        bool handled = handle(type, req, req_len, check_only, f, err, sizeof(err));
+        fclose(f);
+        if (handled && text_len > MAX_PAYLOAD) {
+            snprintf(err, sizeof(err), "%s: output too long", type == 'f' ? req : "<request>");
+            handled = false;
+        }
+        ok = handled ? write_frame(out, 'o', text, text_len) :
+                       write_frame(out, 'e', err, strlen(err));
+        free(text);
+
+        // what the request parsed is gone with the arena, and so are the
+        // symbols and cross-references it added; files it read may change
+        // before the next one
+        arena_reset(&arena);
+        symtab_rollback(0);
+        xref_rollback(saved_xref_mark);
+        pp_revalidate();
+    }
+    free(req);
+    return ok;
+}
+
+bool
+serve(const char * path, bool check_only)
+{
+    // a client that goes away mid-response only ends its connection
+    signal(SIGPIPE, SIG_IGN);
+    if (strcmp(path, "-") == 0)
+        return serve_conn(STDIN_FILENO, STDOUT_FILENO, check_only);
+
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    // a socket left over from an earlier server is replaced, anything else
+    // at path is left alone
+    struct stat st;
+    if (lstat(path, &st) == 0 && S_ISSOCK(st.st_mode))
+        unlink(path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 16) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            perror(path);
+            break;
+        }
+        serve_conn(conn, conn, check_only);
+        close(conn);
+    }
+    close(fd);
+    return false;
+}
+
+// all of stdin, for an 's' request
+static char *
+read_stdin(size_t * len)
+{
+    size_t cap = 1 << 16;
+    char * text = malloc(cap);
+    assert(text);
+    *len = 0;
+    for (size_t n; (n = read_full(STDIN_FILENO, text + *len, cap - *len)) > 0; ) {
+        *len += n;
+        if (*len < cap)
+            break;
+        cap *= 2;
+        text = realloc(text, cap);
+        assert(text);
+    }
+    return text;
+}
+
+bool
+serve_connect(const char * path, char * files[], int num_files)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return false;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        perror(path);
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    // the server has its own working directory, so relative paths are
+    // made absolute here
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd)))
+        cwd[0] = '\0';
+    bool ok = true;
+    char * resp = NULL;
+    size_t resp_cap = 0, resp_len;
+    for (int i = 0; i < num_files; i++) {
+        bool sent;
+        if (strcmp(files[i], "-") == 0) {
+            size_t len;
+            char * text = read_stdin(&len);
+            sent = len <= MAX_REQUEST && write_frame(fd, 's', text, len);
+            free(text);
+        } else if (files[i][0] == '/' || !cwd[0]) {
+            sent = write_frame(fd, 'f', files[i], strlen(files[i]));
+        } else {
+            char buf[8192];
+            int n = snprintf(buf, sizeof(buf), "%s/%s", cwd, files[i]);
+            sent = n < (int) sizeof(buf) && write_frame(fd, 'f', buf, n);
+        }
+        int type;
+        if (!sent || read_frame(fd, MAX_PAYLOAD, &type, &resp, &resp_cap, &resp_len) != FRAME_OK) {
+            fprintf(stderr, "%s: lost connection to %s\n", files[i], path);
+            ok = false;
+            break;
+        }
+        if (type == 'o') {
+            fwrite(resp, 1, resp_len, stdout);
+        } else {
+            fprintf(stderr, "%s\n", resp);
+            ok = false;
+        }
+    }
+    free(resp);
+    close(fd);
+    return ok;
+}
@@ -0,0 +1,26 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdbool.h>
+
+// A long-lived crdp that parses on request, so the header cache, the intern
+// table and the arenas stay warm from one request to the next. Requests and
+// responses are framed alike:
+//
+//   type (1 byte)  length (4 bytes, big-endian)  payload (length bytes)
+//
+// A request of type 'f' names a file to parse, 's' carries source text to
+// parse as a file in the server's directory. The response is 'o' with what
+// crdp would have printed for it (the AST, or nothing for --check), or 'e'
+// with a one-line message; the details of an error go to the server's
+// stderr. A request over 256MB gets an 'e' and its connection is closed.
+// Clients are served one at a time, each for as many requests as it sends
+// before closing its end.
+
+// serve on a Unix domain socket at path, or on stdin and stdout for "-"
+bool serve(const char * path, bool check_only);
+// send each file (source read from stdin for "-") to the server at path,
+// printing the responses
+bool serve_connect(const char * path, char * files[], int num_files);
+
+#endif /* SERVE_H */
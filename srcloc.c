@@ -0,0 +1,207 @@
+#include "srcloc.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+typedef struct {
+    const char * name;
+    const char * text;
+    uint32_t base;
+    uint32_t len;
+    uint32_t span;              // len, or more to leave room for a new text
+    uint32_t * line_starts;     // built on first lookup
+    uint32_t num_lines;
+    int first_line;             // where text starts, for pieces of a file
+    int first_col;
+} srcfile_t;
+
+static srcfile_t * files;
+static size_t num_files;
+static size_t files_cap;
+static uint32_t next_base = 1;
+
+static srcfile_t *
+add_file(const char * name, const char * text, size_t len, size_t span, int line, int col)
+{
+    assert(span < UINT32_MAX - next_base && "source space exhausted");
+    if (num_files >= files_cap) {
+        files_cap = files_cap ? files_cap*2 : 64;
+        files = realloc(files, sizeof(*files)*files_cap);
+        assert(files);
+    }
+    srcfile_t * sp = &files[num_files++];
+    *sp = (srcfile_t) {
+        .name = name,
+        .text = text,
+        .base = next_base,
+        .len = (uint32_t) len,
+        .span = (uint32_t) span,
+        .first_line = line,
+        .first_col = col,
+    };
+    next_base += (uint32_t) span + 1;
+    return sp;
+}
+
+static void build_line_table(srcfile_t * sp);
+
+// Register a file's text. Its locations are base through base+len; the one
+// past the end is for the end of file.
+uint32_t
+srcloc_add_file(const char * name, const char * text, size_t len)
+{
+    return add_file(name, text, len, len, 1, 1)->base;
+}
+
+// Register part of a file that's read a piece at a time, whose text starts
+// at line:col. The line table is built now, so text only has to outlive
+// calls to srcloc_text(). Pieces can be kept for a long run, so the table
+// is trimmed to fit.
+uint32_t
+srcloc_add_piece(const char * name, const char * text, size_t len, int line, int col)
+{
+    srcfile_t * sp = add_file(name, text, len, len, line, col);
+    build_line_table(sp);
+    sp->line_starts = realloc(sp->line_starts, sizeof(*sp->line_starts)*sp->num_lines);
+    assert(sp->line_starts);
+    return sp->base;
+}
+
+// Forget the file registered at base and those registered after it, so
+// their locations are handed out again.
+void
+srcloc_release(uint32_t base)
+{
+    assert(num_files > 0 && base <= files[num_files-1].base);
+    while (num_files > 0 && files[num_files-1].base >= base) {
+        free(files[--num_files].line_starts);
+    }
+    next_base = base;
+}
+
+static srcfile_t * find_file(uint32_t loc);
+
+// Point the file registered at base at new text, for when it has changed.
+// It keeps its locations if the text fits in its range. If not, it moves
+// to a new one with half as much again to grow into, and the old range
+// isn't handed out again, so a file takes at most a few times its largest
+// size however often it changes. Returns the file's base.
+uint32_t
+srcloc_replace(uint32_t base, const char * text, size_t len)
+{
+    srcfile_t * sp = find_file(base);
+    assert(sp && sp->base == base && sp->first_line == 1);
+    free(sp->line_starts);
+    sp->line_starts = NULL;
+    sp->num_lines = 0;
+    if (len <= sp->span) {
+        sp->text = text;
+        sp->len = (uint32_t) len;
+        return base;
+    }
+    const char * name = sp->name;
+    size_t span = (size_t) sp->span + sp->span/2;
+    if (sp == &files[num_files-1])
+        next_base = base;
+    memmove(sp, sp+1, sizeof(*sp)*(&files[num_files] - (sp+1)));
+    num_files--;
+    return add_file(name, text, len, len > span ? len : span, 1, 1)->base;
+}
+
+static srcfile_t *
+find_file(uint32_t loc)
+{
+    if (loc == 0 || num_files == 0)
+        return NULL;
+    size_t lo = 0, hi = num_files;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        if (files[mid].base <= loc)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    srcfile_t * sp = &files[lo];
+    return (loc - sp->base <= sp->len) ? sp : NULL;
+}
+
+static void
+push_line(srcfile_t * sp, uint32_t * cap, uint32_t off)
+{
+    if (sp->num_lines >= *cap) {
+        *cap *= 2;
+        sp->line_starts = realloc(sp->line_starts, sizeof(*sp->line_starts)*(*cap));
+        assert(sp->line_starts);
+    }
+    sp->line_starts[sp->num_lines++] = off;
+}
+
+static void
+build_line_table(srcfile_t * sp)
+{
+    uint32_t cap = 256;
+    sp->line_starts = malloc(sizeof(*sp->line_starts)*cap);
+    assert(sp->line_starts);
+    sp->num_lines = 0;
+    push_line(sp, &cap, 0);
+
+    const char * p = sp->text;
+    uint32_t i = 0;
+#ifdef __SSE2__
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= sp->len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        unsigned m = (unsigned) _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+        while (m) {
+            push_line(sp, &cap, i + __builtin_ctz(m) + 1);
+            m &= m - 1;
+        }
+    }
+#endif
+    for (; i < sp->len; i++) {
+        if (p[i] == '\n')
+            push_line(sp, &cap, i + 1);
+    }
+}
+
+srcpos_t
+srcloc_decode(uint32_t loc)
+{
+    srcfile_t * sp = find_file(loc);
+    if (!sp)
+        return (srcpos_t) { .file = "<unknown>" };
+    if (!sp->line_starts)
+        build_line_table(sp);
+
+    // last line start <= off
+    uint32_t off = loc - sp->base;
+    uint32_t lo = 0, hi = sp->num_lines;
+    while (hi - lo > 1) {
+        uint32_t mid = lo + (hi - lo)/2;
+        if (sp->line_starts[mid] <= off)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return (srcpos_t) {
+        .file = sp->name,
+        .line = sp->first_line + (int) lo,
+        .col = (int)(off - sp->line_starts[lo]) + (lo == 0 ? sp->first_col : 1),
+    };
+}
+
+// source text at loc, and the number of bytes from there to the end of file
+const char *
+srcloc_text(uint32_t loc, size_t * avail)
+{
+    srcfile_t * sp = find_file(loc);
+    if (!sp) {
+        *avail = 0;
+        return NULL;
+    }
+    *avail = sp->len - (loc - sp->base);
+    return sp->text + (loc - sp->base);
+}
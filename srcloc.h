@@ -0,0 +1,24 @@
+#ifndef SRCLOC_H
+#define SRCLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// A source location is a 32-bit offset into one address space that holds
+// every file read, each at its own base. Location 0 means "nowhere". Line and
+// column are only worked out when someone asks for them.
+
+typedef struct {
+    const char * file;
+    int line;
+    int col;
+} srcpos_t;
+
+uint32_t    srcloc_add_file(const char * name, const char * text, size_t len);
+uint32_t    srcloc_add_piece(const char * name, const char * text, size_t len, int line, int col);
+uint32_t    srcloc_replace(uint32_t base, const char * text, size_t len);
+void        srcloc_release(uint32_t base);
+srcpos_t    srcloc_decode(uint32_t loc);
+const char * srcloc_text(uint32_t loc, size_t * avail);
+
+#endif /* SRCLOC_H */
@@ -0,0 +1,243 @@
+#include "strlit.h"
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <assert.h>
+
+// start of the quoted part, after any encoding prefix
+static const char *
+skip_prefix(const char * s)
+{
+    if (s[0] == 'u' && s[1] == '8')
+        return s+2;
+    if (s[0] == 'L' || s[0] == 'u' || s[0] == 'U')
+        return s+1;
+    return s;
+}
+
+// L, u and U literals hold code units wider than a byte
+static bool
+is_wide(const char * s)
+{
+    return skip_prefix(s) - s == 1;
+}
+
+size_t
+strlit_raw_len(const char * s)
+{
+    const char * p = skip_prefix(s);
+    char close = (*p == '<') ? '>' : *p;
+    for (p++; *p != close; p++) {
+        if (*p == '\\' && close != '>')
+            p++;
+    }
+    return p+1 - s;
+}
+
+static size_t
+splice_len(const char * p, const char * end)
+{
+    if (p+1 < end && p[0] == '\\' && p[1] == '\n')
+        return 2;
+    if (p+2 < end && p[0] == '\\' && p[1] == '\r' && p[2] == '\n')
+        return 3;
+    return 0;
+}
+
+size_t
+strlit_spell(token_t t, char * buf, size_t sz)
+{
+    const char * s = t.u.c_s;
+    const char * end = s + strlit_raw_len(s);
+    size_t n = 0;
+    if (!(t.flags & TF_ESCAPE)) {
+        n = end - s;
+        if (sz > 0)
+            memcpy(buf, s, n < sz ? n : sz-1);
+    } else {
+        for (const char * p = s; p < end; ) {
+            size_t k = splice_len(p, end);
+            if (k) {
+                p += k;
+                continue;
+            }
+            if (n+1 < sz)
+                buf[n] = *p;
+            n++;
+            p++;
+        }
+    }
+    if (sz > 0)
+        buf[n < sz ? n : sz-1] = '\0';
+    return n;
+}
+
+// the escape sequence after the backslash at p; sets *v, and *ucn when it
+// names a code point rather than a code unit
+static const char *
+decode_escape(const char * p, const char * end, uint32_t * v, bool * ucn)
+{
+    int ndigits;
+    *ucn = false;
+    switch (*p) {
+        case 'n': *v = '\n'; return p+1;
+        case 't': *v = '\t'; return p+1;
+        case 'r': *v = '\r'; return p+1;
+        case 'a': *v = '\a'; return p+1;
+        case 'b': *v = '\b'; return p+1;
+        case 'f': *v = '\f'; return p+1;
+        case 'v': *v = '\v'; return p+1;
+        case 'x':
+            for (*v = 0, p++; p < end && isxdigit((unsigned char) *p); p++) {
+                *v = *v*16 + (isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a') + 10);
+            }
+            return p;
+        case 'u':
+        case 'U':
+            ndigits = (*p == 'u') ? 4 : 8;
+            for (*v = 0, p++; ndigits > 0 && p < end && isxdigit((unsigned char) *p); p++, ndigits--) {
+                *v = *v*16 + (isdigit((unsigned char) *p) ? *p - '0' : (tolower((unsigned char) *p) - 'a') + 10);
+            }
+            *ucn = true;
+            return p;
+        default:
+            if (*p >= '0' && *p <= '7') {
+                *v = 0;
+                for (ndigits = 3; ndigits > 0 && p < end && *p >= '0' && *p <= '7'; p++, ndigits--) {
+                    *v = *v*8 + (*p - '0');
+                }
+                return p;
+            }
+            // \' \" \? \\ and anything unknown stand for themselves
+            *v = (unsigned char) *p;
+            return p+1;
+    }
+}
+
+static size_t
+put_byte(char * buf, size_t sz, size_t n, uint32_t b)
+{
+    if (n < sz)
+        buf[n] = (char) b;
+    return n+1;
+}
+
+static size_t
+put_utf8(char * buf, size_t sz, size_t n, uint32_t cp)
+{
+    if (cp < 0x80)
+        return put_byte(buf, sz, n, cp);
+    if (cp < 0x800) {
+        n = put_byte(buf, sz, n, 0xc0 | (cp >> 6));
+    } else if (cp < 0x10000) {
+        n = put_byte(buf, sz, n, 0xe0 | (cp >> 12));
+        n = put_byte(buf, sz, n, 0x80 | ((cp >> 6) & 0x3f));
+    } else {
+        n = put_byte(buf, sz, n, 0xf0 | ((cp >> 18) & 0x07));
+        n = put_byte(buf, sz, n, 0x80 | ((cp >> 12) & 0x3f));
+        n = put_byte(buf, sz, n, 0x80 | ((cp >> 6) & 0x3f));
+    }
+    return put_byte(buf, sz, n, 0x80 | (cp & 0x3f));
+}
+
+// append the value of t to buf[n..sz); returns the new untruncated length
+static size_t
+decode(token_t t, bool wide, char * buf, size_t sz, size_t n)
+{
+    const char * s = t.u.c_s;
+    const char * p = skip_prefix(s) + 1;
+    const char * end = s + strlit_raw_len(s) - 1;
+    if (!(t.flags & TF_ESCAPE)) {
+        size_t len = end - p;
+        if (n < sz)
+            memcpy(buf + n, p, len < sz - n ? len : sz - n);
+        return n + len;
+    }
+    while (p < end) {
+        uint32_t v;
+        bool ucn;
+        size_t k = splice_len(p, end);
+        if (k) {
+            p += k;
+        } else if (*p == '\\') {
+            p = decode_escape(p+1, end, &v, &ucn);
+            n = (ucn || wide) ? put_utf8(buf, sz, n, v) : put_byte(buf, sz, n, v & 0xff);
+        } else {
+            n = put_byte(buf, sz, n, (unsigned char) *p++);
+        }
+    }
+    return n;
+}
+
+size_t
+strlit_decode(token_t t, char * buf, size_t sz)
+{
+    return decode(t, is_wide(t.u.c_s), buf, sz, 0);
+}
+
+const char *
+strlit_value(token_t t, arena_t * ap, size_t * len)
+{
+    if (!(t.flags & TF_ESCAPE)) {
+        const char * p = skip_prefix(t.u.c_s) + 1;
+        *len = strlit_raw_len(t.u.c_s) - (p - t.u.c_s) - 1;
+        return p;
+    }
+    *len = strlit_decode(t, NULL, 0);
+    char * s = arena_alloc(ap, *len + 1);
+    strlit_decode(t, s, *len);
+    s[*len] = '\0';
+    return s;
+}
+
+size_t
+strlit_concat(const token_t * toks, int n, char * buf, size_t sz)
+{
+    // one wide piece makes the whole literal wide
+    bool wide = false;
+    for (int i = 0; i < n; i++) {
+        wide |= is_wide(toks[i].u.c_s);
+    }
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+        len = decode(toks[i], wide, buf, sz, len);
+    }
+    return len;
+}
+
+long long
+strlit_char_value(token_t t)
+{
+    const char * p = skip_prefix(t.u.c_s) + 1;
+    const char * end = t.u.c_s + strlit_raw_len(t.u.c_s) - 1;
+    bool wide = is_wide(t.u.c_s);
+    uint32_t v = 0;
+    int n = 0;
+    while (p < end) {
+        uint32_t c;
+        bool ucn = false;
+        size_t k = splice_len(p, end);
+        if (k) {
+            p += k;
+            continue;
+        }
+        if (*p == '\\')
+            p = decode_escape(p+1, end, &c, &ucn);
+        else
+            c = (unsigned char) *p++;
+        if (wide) {
+            v = c;
+            continue;
+        }
+        // a code point in a plain literal is its UTF-8 bytes
+        char bytes[4];
+        size_t len = ucn ? put_utf8(bytes, sizeof(bytes), 0, c) : put_byte(bytes, 1, 0, c);
+        for (size_t i = 0; i < len; i++, n++) {
+            v = (v << 8) | (unsigned char) bytes[i];
+        }
+    }
+    if (wide)
+        return v;
+    return n == 1 ? (signed char) v : (int32_t) v;
+}
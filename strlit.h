@@ -0,0 +1,37 @@
+#ifndef STRLIT_H
+#define STRLIT_H
+
+#include "tokenizer.h"
+#include "arena.h"
+
+// String and character literal tokens point at their raw spelling, prefix
+// and quotes included, wherever it was lexed from, and aren't unescaped
+// until someone asks for the value. TF_ESCAPE says a backslash is present.
+// Values are UTF-8; escapes above 0xff in a narrow literal keep their low
+// byte.
+
+// Length of the raw spelling at s, through the closing quote (or '>' for a
+// header name).
+size_t  strlit_raw_len(const char * s);
+
+// Write the spelling of t to buf with any line splices removed, truncating
+// to fit. Returns the length of the untruncated spelling.
+size_t  strlit_spell(token_t t, char * buf, size_t sz);
+
+// Decode the value of t, without quotes or a terminating NUL, into buf,
+// truncating to fit. Returns the length of the untruncated value.
+size_t  strlit_decode(token_t t, char * buf, size_t sz);
+
+// Value of t. Without escapes this points into the token's own spelling and
+// isn't NUL-terminated; otherwise it's decoded into ap and is.
+const char * strlit_value(token_t t, arena_t * ap, size_t * len);
+
+// Decode the run of adjacent string literals toks[0..n) as one literal.
+size_t  strlit_concat(const token_t * toks, int n, char * buf, size_t sz);
+
+// Value of a character literal, as gcc works it out: a plain one is a
+// signed char, or if it holds more than one byte an int with the bytes
+// shifted in first to last; a wide one is its last character.
+long long strlit_char_value(token_t t);
+
+#endif /* STRLIT_H */
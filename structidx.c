@@ -0,0 +1,428 @@
+#include "structidx.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+// The carry-less multiply is compiled in for x86-64 whatever -m flags the
+// build uses, and only run where the CPU has it.
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <wmmintrin.h>
+#define HAVE_CLMUL 1
+#endif
+
+// This follows simdjson's stage 1: each 64-byte block becomes one bitmask
+// per interesting character, escaped characters are found from the runs of
+// backslashes, and the inside of a literal is the prefix XOR of the quotes
+// that aren't escaped. C has more kinds of region than JSON, though, and
+// comments, directives and the two kinds of quote can hide one another. A
+// block with a comment opener, a '#' or both kinds of quote, or one that
+// starts inside a comment or directive, is walked a byte at a time instead.
+
+enum {
+    REGION_CODE,
+    REGION_STRING,
+    REGION_CHAR,
+    REGION_BLOCK_COMMENT,
+    REGION_LINE_COMMENT,
+};
+
+struct structidx_scan_t {
+    size_t off;         // of the next byte fed
+    int region;
+    bool in_directive;
+    bool bol;           // only whitespace since the last newline
+    bool escaped;       // the next byte follows an odd run of backslashes
+    bool slash;         // the last byte was a '/' in code
+    bool star;          // the last byte was a '*' in a block comment
+    bool paren;         // the last byte of code, but for blanks and '/', was ')'
+    int depth;
+    structidx_t * ix;   // being appended to
+};
+
+typedef structidx_scan_t scan_t;
+
+typedef struct {
+    uint64_t backslash;
+    uint64_t dquote;
+    uint64_t squote;
+    uint64_t slash;
+    uint64_t star;
+    uint64_t hash;
+    uint64_t newline;
+    uint64_t space;     // including newlines
+    uint64_t structural;
+} masks_t;
+
+#define EVEN_BITS 0x5555555555555555ull
+
+#ifdef __SSE2__
+static uint64_t
+eq_mask(const __m128i v[4], char c)
+{
+    __m128i k = _mm_set1_epi8(c);
+    uint64_t m = 0;
+    for (int i = 0; i < 4; i++) {
+        m |= (uint64_t)(uint16_t) _mm_movemask_epi8(_mm_cmpeq_epi8(v[i], k)) << (16*i);
+    }
+    return m;
+}
+
+static masks_t
+classify(const char * p)
+{
+    __m128i v[4];
+    for (int i = 0; i < 4; i++) {
+        v[i] = _mm_loadu_si128((const __m128i *) (p + 16*i));
+    }
+    masks_t m = {
+        .backslash  = eq_mask(v, '\\'),
+        .dquote     = eq_mask(v, '"'),
+        .squote     = eq_mask(v, '\''),
+        .slash      = eq_mask(v, '/'),
+        .star       = eq_mask(v, '*'),
+        .hash       = eq_mask(v, '#'),
+        .newline    = eq_mask(v, '\n'),
+    };
+    m.space = m.newline | eq_mask(v, ' ') | eq_mask(v, '\t') | eq_mask(v, '\r') | eq_mask(v, '\f') | eq_mask(v, '\v');
+    m.structural = eq_mask(v, '{') | eq_mask(v, '}') | eq_mask(v, '(') | eq_mask(v, ')') | eq_mask(v, ';') | eq_mask(v, ',');
+    return m;
+}
+#else
+static masks_t
+classify(const char * p)
+{
+    masks_t m = { 0 };
+    for (int i = 0; i < 64; i++) {
+        uint64_t bit = (uint64_t) 1 << i;
+        switch (p[i]) {
+            case '\\':  m.backslash |= bit;     break;
+            case '"':   m.dquote |= bit;        break;
+            case '\'':  m.squote |= bit;        break;
+            case '/':   m.slash |= bit;         break;
+            case '*':   m.star |= bit;          break;
+            case '#':   m.hash |= bit;          break;
+            case '\n':  m.newline |= bit;       m.space |= bit;         break;
+            case ' ': case '\t': case '\r': case '\f': case '\v':
+                m.space |= bit;
+                break;
+            case '{': case '}': case '(': case ')': case ';': case ',':
+                m.structural |= bit;
+                break;
+            default: ;
+        }
+    }
+    return m;
+}
+#endif
+
+#ifdef HAVE_CLMUL
+__attribute__((target("pclmul")))
+static uint64_t
+prefix_xor_clmul(uint64_t x)
+{
+    __m128i r = _mm_clmulepi64_si128(_mm_set_epi64x(0, (long long) x), _mm_set1_epi8((char) 0xff), 0);
+    return (uint64_t) _mm_cvtsi128_si64(r);
+}
+#endif
+
+// bit i is the XOR of bits 0..i
+static uint64_t
+prefix_xor(uint64_t x)
+{
+#ifdef HAVE_CLMUL
+    if (__builtin_cpu_supports("pclmul"))
+        return prefix_xor_clmul(x);
+#endif
+    x ^= x << 1;
+    x ^= x << 2;
+    x ^= x << 4;
+    x ^= x << 8;
+    x ^= x << 16;
+    x ^= x << 32;
+    return x;
+}
+
+static void
+emit(scan_t * sp, size_t off, char c, bool after_paren)
+{
+    if (c == '}' || c == ')') {
+        if (sp->depth > 0)
+            sp->depth--;
+    }
+    structidx_t * ix = sp->ix;
+    assert(ix->num_pos < ix->cap);
+    ix->pos[ix->num_pos++] = (struct_pos_t) {
+        .off = (uint32_t) off,
+        .depth = sp->depth > UINT16_MAX ? UINT16_MAX : (uint16_t) sp->depth,
+        .c = c,
+        .after_paren = after_paren,
+    };
+    if (c == '{' || c == '(')
+        sp->depth++;
+}
+
+static void
+scan_bytes(scan_t * sp, const char * p, size_t len, size_t off)
+{
+    for (size_t i = 0; i < len; i++) {
+        char c = p[i];
+        bool esc = sp->escaped;
+        sp->escaped = (c == '\\' && !esc);
+        switch (sp->region) {
+            case REGION_STRING:
+            case REGION_CHAR:
+                if (!esc && c == (sp->region == REGION_STRING ? '"' : '\''))
+                    sp->region = REGION_CODE;
+                else if (!esc && c == '\n')
+                    goto newline;   // unterminated
+                continue;
+            case REGION_BLOCK_COMMENT:
+                if (c == '/' && sp->star)
+                    sp->region = REGION_CODE;
+                sp->star = (c == '*');
+                continue;
+            case REGION_LINE_COMMENT:
+                if (!esc && c == '\n')
+                    goto newline;
+                continue;
+            default: ;
+        }
+        if (sp->slash && (c == '*' || c == '/')) {
+            sp->region = (c == '*') ? REGION_BLOCK_COMMENT : REGION_LINE_COMMENT;
+            sp->slash = sp->star = false;
+            continue;
+        }
+        sp->slash = (c == '/');
+        if (c == '\n') {
+newline:
+            sp->region = REGION_CODE;
+            if (!esc) {
+                sp->in_directive = false;
+                sp->bol = true;
+            }
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v')
+            continue;
+        if (c == '"' && !esc) {
+            sp->region = REGION_STRING;
+        } else if (c == '\'' && !esc) {
+            sp->region = REGION_CHAR;
+        } else if (c == '#' && sp->bol) {
+            sp->in_directive = true;
+        } else if (!sp->in_directive && (c == '{' || c == '}' || c == '(' || c == ')' || c == ';' || c == ',')) {
+            emit(sp, off + i, c, sp->paren);
+        }
+        // a '/' may start a comment, so it's left out
+        if (!sp->in_directive && c != '/')
+            sp->paren = (c == ')');
+        sp->bol = false;
+    }
+}
+
+// Scan one 64-byte block with bit operations, or return false if it needs
+// scan_bytes().
+static bool
+scan_block(scan_t * sp, const char * block, size_t off)
+{
+    if (sp->in_directive)
+        return false;
+    masks_t m = classify(block);
+
+    // bytes that follow an odd run of backslashes
+    uint64_t prev_escaped = sp->escaped;
+    uint64_t bs = m.backslash & ~prev_escaped;
+    uint64_t follows_escape = bs << 1 | prev_escaped;
+    uint64_t odd_starts = bs & ~EVEN_BITS & ~follows_escape;
+    uint64_t even_seqs = odd_starts + bs;
+    bool carry = even_seqs < odd_starts;
+    uint64_t escaped = (EVEN_BITS ^ (even_seqs << 1)) & follows_escape;
+
+    // a comment that doesn't end in this block hides all of it
+    if (sp->region == REGION_BLOCK_COMMENT) {
+        if ((((m.star << 1) | sp->star) & m.slash) != 0)
+            return false;
+        sp->star = (m.star >> 63) != 0;
+        sp->escaped = carry;
+        return true;
+    }
+    if (sp->region == REGION_LINE_COMMENT) {
+        if (m.newline & ~escaped)
+            return false;
+        sp->escaped = carry;
+        return true;
+    }
+
+    if (m.hash)
+        return false;
+    if ((((m.slash << 1) | sp->slash) & (m.star | m.slash)) != 0)
+        return false;
+
+    uint64_t dq = m.dquote & ~escaped;
+    uint64_t sq = m.squote & ~escaped;
+    int kind;
+    if (sp->region == REGION_STRING && !sq)
+        kind = REGION_STRING;
+    else if (sp->region == REGION_CHAR && !dq)
+        kind = REGION_CHAR;
+    else if (sp->region == REGION_CODE && !(dq && sq))
+        kind = dq ? REGION_STRING : REGION_CHAR;
+    else
+        return false;
+
+    uint64_t quotes = dq | sq;
+    uint64_t inside = prefix_xor(quotes) ^ (sp->region != REGION_CODE ? ~(uint64_t) 0 : 0);
+    uint64_t code = ~inside;
+    uint64_t nonspace = ~m.space & (code | quotes);
+    uint64_t newline = m.newline & ~escaped;
+    if (newline & inside)
+        return false;   // unterminated literal
+
+    // the bytes that decide paren, as in scan_bytes()
+    uint64_t sig = nonspace & ~m.slash;
+    for (uint64_t s = m.structural & code; s; s &= s-1) {
+        int i = __builtin_ctzll(s);
+        uint64_t before = sig & (((uint64_t) 1 << i) - 1);
+        bool paren = before ? block[63 - __builtin_clzll(before)] == ')' : sp->paren;
+        emit(sp, off + i, block[i], paren);
+    }
+    if (sig)
+        sp->paren = block[63 - __builtin_clzll(sig)] == ')';
+
+    if (newline) {
+        int last = 63 - __builtin_clzll(newline);
+        sp->bol = ((nonspace >> last) >> 1) == 0;
+    } else {
+        sp->bol = sp->bol && nonspace == 0;
+    }
+    sp->region = (inside >> 63) ? kind : REGION_CODE;
+    sp->escaped = carry;
+    sp->slash = ((m.slash & code) >> 63) != 0;
+    return true;
+}
+
+structidx_scan_t *
+structidx_scan_new()
+{
+    scan_t * sp = malloc(sizeof(*sp));
+    assert(sp);
+    *sp = (scan_t) { .region = REGION_CODE, .bol = true };
+    return sp;
+}
+
+void
+structidx_scan_free(structidx_scan_t * sp)
+{
+    free(sp);
+}
+
+void
+structidx_scan_feed(structidx_scan_t * sp, const char * p, size_t len, structidx_t * ix)
+{
+    sp->ix = ix;
+    for (size_t i = 0; i < len; i += 64) {
+        size_t n = len - i < 64 ? len - i : 64;
+        if (ix->num_pos + 64 > ix->cap) {
+            ix->cap = ix->cap ? ix->cap*2 : 1024;
+            ix->pos = realloc(ix->pos, sizeof(*ix->pos)*ix->cap);
+            assert(ix->pos);
+        }
+        // the state carries over exactly, so a short tail is done a byte at
+        // a time rather than padded
+        if (n < 64 || !scan_block(sp, p + i, sp->off + i))
+            scan_bytes(sp, p + i, n, sp->off + i);
+    }
+    sp->off += len;
+    sp->ix = NULL;
+}
+
+structidx_t
+structidx_build(const char * src, size_t len)
+{
+    structidx_t ix = { 0 };
+    structidx_scan_t * sp = structidx_scan_new();
+    structidx_scan_feed(sp, src, len, &ix);
+    structidx_scan_free(sp);
+    return ix;
+}
+
+void
+structidx_free(structidx_t * ix)
+{
+    free(ix->pos);
+    *ix = (structidx_t) { 0 };
+}
+
+// skip whitespace, comments and directives from i
+static size_t
+skip_blank(const char * src, size_t i, size_t len, bool bol)
+{
+    while (i < len) {
+        char c = src[i];
+        if (c == '\n') {
+            bol = true;
+            i++;
+        } else if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            i++;
+        } else if (c == '/' && i+1 < len && src[i+1] == '*') {
+            for (i += 2; i+1 < len && !(src[i] == '*' && src[i+1] == '/'); i++)
+                ;
+            i += 2;
+        } else if (c == '/' && i+1 < len && src[i+1] == '/') {
+            while (i < len && src[i] != '\n') {
+                i++;
+            }
+        } else if (c == '#' && bol) {
+            for (; i < len && !(src[i] == '\n' && src[i-1] != '\\'); i++)
+                ;
+        } else {
+            break;
+        }
+    }
+    return i < len ? i : len;
+}
+
+bool
+structidx_ends_decl(struct_pos_t p, bool * in_body)
+{
+    if (p.depth != 0)
+        return false;
+    if (p.c == ';' && !*in_body)
+        return true;
+    if (p.c == '{' && !*in_body) {
+        // a function body follows the ')' of its declarator
+        *in_body = p.after_paren;
+        return false;
+    }
+    if (p.c == '}' && *in_body) {
+        *in_body = false;
+        return true;
+    }
+    return false;
+}
+
+size_t
+structidx_decls(const char * src, size_t len, const structidx_t * ix, decl_span_t ** spans)
+{
+    size_t n = 0, cap = 64;
+    decl_span_t * out = malloc(sizeof(*out)*cap);
+    assert(out);
+    size_t begin = skip_blank(src, 0, len, true);
+    bool in_body = false;
+    for (size_t i = 0; i < ix->num_pos; i++) {
+        struct_pos_t p = ix->pos[i];
+        if (!structidx_ends_decl(p, &in_body))
+            continue;
+        if (n >= cap) {
+            cap *= 2;
+            out = realloc(out, sizeof(*out)*cap);
+            assert(out);
+        }
+        out[n++] = (decl_span_t) { .begin = (uint32_t) begin, .end = p.off + 1 };
+        begin = skip_blank(src, p.off + 1, len, false);
+    }
+    *spans = out;
+    return n;
+}
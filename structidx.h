@@ -0,0 +1,53 @@
+#ifndef STRUCTIDX_H
+#define STRUCTIDX_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// A structural index lists where the { } ( ) ; , of a source file are,
+// leaving out those in comments, string and character literals and
+// preprocessor directives. It's built straight from the text, 64 bytes at a
+// time, without lexing or preprocessing.
+
+typedef struct {
+    uint32_t off;
+    uint16_t depth;     // { and ( around it; an opener and its closer share one
+    char c;
+    bool after_paren;   // the code before it, past blanks and comments, ends in ')'
+} struct_pos_t;
+
+typedef struct {
+    struct_pos_t * pos;
+    size_t num_pos;
+    size_t cap;
+} structidx_t;
+
+// [begin, end) of one top-level declaration or function definition
+typedef struct {
+    uint32_t begin;
+    uint32_t end;
+} decl_span_t;
+
+structidx_t structidx_build(const char * src, size_t len);
+void        structidx_free(structidx_t * ix);
+
+// For text that arrives in pieces: each feed appends the entries for the
+// next len bytes to ix, with offsets counted from the start of the first
+// piece. The caller may empty ix between feeds.
+typedef struct structidx_scan_t structidx_scan_t;
+
+structidx_scan_t * structidx_scan_new();
+void        structidx_scan_free(structidx_scan_t * sp);
+void        structidx_scan_feed(structidx_scan_t * sp, const char * p, size_t len, structidx_t * ix);
+
+// Top-level declaration boundaries: a ';' at depth 0, or the '}' closing a
+// function body, ends one. Returns how many were found; *spans is malloc'd.
+size_t      structidx_decls(const char * src, size_t len, const structidx_t * ix, decl_span_t ** spans);
+
+// Whether entry p ends a top-level declaration, for callers going through
+// the entries in order. *in_body carries over between calls, starting out
+// false.
+bool        structidx_ends_decl(struct_pos_t p, bool * in_body);
+
+#endif /* STRUCTIDX_H */
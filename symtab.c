@@ -0,0 +1,89 @@
+#include "symtab.h"
+#include "ptrmap.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+// name -> sym_kind_t; SYM_NONE is 0, so names never defined read as it
+static ptrmap_t syms;
+
+// an entry with a NULL name marks the start of a scope
+typedef struct {
+    const char * name;
+    sym_kind_t prev_kind;
+} sym_undo_t;
+
+static sym_undo_t * undo_log;
+static size_t undo_len;
+static size_t undo_cap;
+
+static void
+set_kind(const char * name, sym_kind_t kind)
+{
+    ptrmap_put(&syms, name, (void *)(uintptr_t) kind);
+}
+
+static void
+log_undo(const char * name, sym_kind_t prev_kind)
+{
+    if (undo_len >= undo_cap) {
+        undo_cap = undo_cap ? undo_cap*2 : 256;
+        undo_log = realloc(undo_log, sizeof(*undo_log)*undo_cap);
+        assert(undo_log);
+    }
+    undo_log[undo_len++] = (sym_undo_t) { .name = name, .prev_kind = prev_kind };
+}
+
+void
+symtab_define(const char * name, sym_kind_t kind)
+{
+    assert(name);
+    sym_kind_t prev_kind = symtab_lookup(name);
+    // no-op redefinitions, common at file scope, needn't be undone
+    if (prev_kind == kind)
+        return;
+    log_undo(name, prev_kind);
+    set_kind(name, kind);
+}
+
+sym_kind_t
+symtab_lookup(const char * name)
+{
+    return (sym_kind_t)(uintptr_t) ptrmap_get(&syms, name);
+}
+
+void
+symtab_push_scope()
+{
+    log_undo(NULL, SYM_NONE);
+}
+
+void
+symtab_pop_scope()
+{
+    while (undo_len > 0) {
+        sym_undo_t u = undo_log[--undo_len];
+        if (!u.name)
+            return;
+        set_kind(u.name, u.prev_kind);
+    }
+    assert(0 && "no scope to pop");
+}
+
+size_t
+symtab_mark()
+{
+    return undo_len;
+}
+
+void
+symtab_rollback(size_t mark)
+{
+    assert(mark <= undo_len);
+    while (undo_len > mark) {
+        sym_undo_t u = undo_log[--undo_len];
+        if (u.name) {
+            set_kind(u.name, u.prev_kind);
+        }
+    }
+}
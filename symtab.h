@@ -0,0 +1,24 @@
+#ifndef SYMTAB_H
+#define SYMTAB_H
+
+#include <stddef.h>
+
+// Scoped table of ordinary identifiers, keyed by interned name. Entering a
+// scope and defining a name both append to an undo log, so leaving a scope or
+// backtracking out of a failed parse is a matter of replaying the log back to
+// a mark.
+
+typedef enum {
+    SYM_NONE,
+    SYM_OBJECT,     // variable, function or parameter
+    SYM_TYPEDEF,
+} sym_kind_t;
+
+void        symtab_define(const char * name, sym_kind_t kind);
+sym_kind_t  symtab_lookup(const char * name);
+void        symtab_push_scope();
+void        symtab_pop_scope();
+size_t      symtab_mark();
+void        symtab_rollback(size_t mark);
+
+#endif /* SYMTAB_H */
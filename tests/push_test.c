@@ -0,0 +1,169 @@
+// Drives the push parser from a pipe, a piece at a time, split at every
+// offset: each declaration has to reach the callback during the feed that
+// brings its last byte, with the directive and blank lines around it
+// dropped.
+#include "push.h"
+#include "parser.h"
+#include "tokenizer.h"
+#include "arena.h"
+#include "symtab.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+// each declaration, and the name it declares, with directives, blank lines
+// and comments between them
+static const struct {
+    const char * before;
+    const char * text;
+    const char * name;
+} decls[] = {
+    { "# 1 \"t.c\"\n\n",        "typedef int T;",                                   "T" },
+    { "\n#pragma once\n",       "int f(int a, char * b);",                          "f" },
+    { " /* } { ; */\n",         "T g() { return \"}{;\"[0] + /* } */ 1; }",         "g" },
+    { "\n# 7 \"t.c\" 2\n",      "char * s() { return \"a}b{c;/*\"; }",              "s" },
+    { "// ;\n#define X {\n",    "int h(int a) { int z; z = a * 2; return (z); }",   "h" },
+    { "\n\n",                   "int c() { return '}' + ';' + '\\''; }",            "c" },
+    { "\n#if 0\n#endif\n",      "int x;",                                           "x" },
+};
+#define NUM_DECLS ((int)(sizeof(decls)/sizeof(*decls)))
+
+static char text[4096];
+static size_t len;
+static size_t ends[NUM_DECLS];      // offset of each declaration's last byte
+
+// the input fed so far, before and after the current feed
+static size_t fed_before, fed_after;
+static int num_seen;
+static bool failed;
+
+static void
+fail(const char * msg, size_t split)
+{
+    fprintf(stderr, "push_test: split at %zu: declaration %d: %s\n", split, num_seen, msg);
+    failed = true;
+}
+
+static size_t cur_split;
+
+static bool
+check_decl(ast_node_t * decl, void * ctx)
+{
+    if (num_seen >= NUM_DECLS) {
+        fail("too many declarations", cur_split);
+        return false;
+    }
+    size_t end = ends[num_seen];
+    if (end < fed_before || end >= fed_after)
+        fail("not passed on in the feed that completed it", cur_split);
+    ast_node_t * id = ast_num_children(decl) > 1 ? ast_child(decl, 1) : NULL;
+    if (!id || !ast_str(id) || strcmp(ast_str(id), decls[num_seen].name) != 0)
+        fail("wrong declaration", cur_split);
+    num_seen++;
+    return false;
+}
+
+// feed text through a pipe in pieces of at most max_piece bytes, the first
+// ending at split
+static bool
+run(size_t split, size_t max_piece)
+{
+    int fds[2];
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        exit(EXIT_FAILURE);
+    }
+    cur_split = split;
+    num_seen = 0;
+    fed_before = fed_after = 0;
+    push_parser_t * ps = push_parser_new("t.c", check_decl, NULL);
+    bool ok = true;
+    for (size_t off = 0; ok && off < len; ) {
+        size_t n = off < split ? split - off : len - off;
+        if (n > max_piece)
+            n = max_piece;
+        if (write(fds[1], text + off, n) != (ssize_t) n) {
+            perror("write");
+            exit(EXIT_FAILURE);
+        }
+        char buf[sizeof(text)];
+        ssize_t got = read(fds[0], buf, n);
+        if (got != (ssize_t) n) {
+            perror("read");
+            exit(EXIT_FAILURE);
+        }
+        fed_before = off;
+        fed_after = off += n;
+        ok = push_parser_feed(ps, buf, n);
+    }
+    ok = ok && push_parser_finish(ps);
+    push_parser_free(ps);
+    close(fds[0]);
+    close(fds[1]);
+    arena_reset(&arena);
+    symtab_rollback(0);
+    if (!ok)
+        fail("parse error", split);
+    else if (num_seen != NUM_DECLS)
+        fail("missing declarations", split);
+    return ok;
+}
+
+static bool
+drop_decl(ast_node_t * decl, void * ctx)
+{
+    return false;
+}
+
+// whether src on its own parses
+static bool
+parses(const char * src)
+{
+    // the error it's expected to print isn't wanted
+    int saved = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDERR_FILENO);
+    push_parser_t * ps = push_parser_new("t.c", drop_decl, NULL);
+    bool ok = push_parser_feed(ps, src, strlen(src)) && push_parser_finish(ps);
+    push_parser_free(ps);
+    arena_reset(&arena);
+    symtab_rollback(0);
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    close(null);
+    return ok;
+}
+
+int
+main()
+{
+    arena = arena_init_vm((size_t) 1 << 30, 0);
+    tokenizer_init();
+
+    for (int i = 0; i < NUM_DECLS; i++) {
+        len += (size_t) sprintf(text + len, "%s%s", decls[i].before, decls[i].text);
+        ends[i] = len - 1;
+    }
+    len += (size_t) sprintf(text + len, "\n# 99 \"t.c\"\n");
+
+    // split in two at every offset, so inside every comment, literal and
+    // body, then a byte at a time
+    for (size_t split = 0; split <= len; split++) {
+        run(split, len);
+    }
+    run(0, 1);
+
+    // after a block comment has spanned lines, the line doesn't start with
+    // the '#', so it's no directive, as with gcc
+    if (parses("int a; /* c\n */ #define Q 1\n")) {
+        fprintf(stderr, "push_test: '#' after a comment's newline taken as a directive\n");
+        failed = true;
+    }
+    if (!parses("int a; /* c\n */\n#define Q 1\n")) {
+        fprintf(stderr, "push_test: directive after a comment not dropped\n");
+        failed = true;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
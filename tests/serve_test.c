@@ -0,0 +1,264 @@
+// Talks to the server over stdin and stdout, and over a Unix domain socket:
+// both request types, requests that fail, one that's too long, truncated
+// frames, and that what one request defines is gone by the next.
+#define _DEFAULT_SOURCE
+#include "serve.h"
+#include "tokenizer.h"
+#include "arena.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+// serve.h's limit on a request
+#define MAX_REQUEST (1u << 28)
+
+static bool failed;
+static char dir[] = "/tmp/serve_testXXXXXX";
+
+static void
+fail(const char * what, const char * msg)
+{
+    fprintf(stderr, "serve_test: %s: %s\n", what, msg);
+    failed = true;
+}
+
+static void
+write_all(int fd, const void * buf, size_t len)
+{
+    if (write(fd, buf, len) != (ssize_t) len) {
+        perror("serve_test: write");
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void
+send_header(int fd, int type, uint32_t len)
+{
+    unsigned char hdr[5] = { type, len >> 24, len >> 16, len >> 8, len };
+    write_all(fd, hdr, sizeof(hdr));
+}
+
+static void
+send_frame(int fd, int type, const char * payload)
+{
+    send_header(fd, type, (uint32_t) strlen(payload));
+    write_all(fd, payload, strlen(payload));
+}
+
+// Read a response, returning its type, or 0 if the server closed the
+// connection before a whole one. *payload is malloc'd and NUL-terminated.
+static int
+recv_frame(int fd, char ** payload)
+{
+    unsigned char hdr[5];
+    size_t n = 0;
+    *payload = NULL;
+    for (ssize_t r; n < sizeof(hdr) && (r = read(fd, hdr + n, sizeof(hdr) - n)) > 0; ) {
+        n += r;
+    }
+    if (n < sizeof(hdr))
+        return 0;
+    size_t len = (size_t) hdr[1] << 24 | hdr[2] << 16 | hdr[3] << 8 | hdr[4];
+    *payload = malloc(len + 1);
+    n = 0;
+    for (ssize_t r; n < len && (r = read(fd, *payload + n, len - n)) > 0; ) {
+        n += r;
+    }
+    (*payload)[n] = '\0';
+    return n == len ? hdr[0] : 0;
+}
+
+// Send one request and check the response's type, and that its payload has
+// want in it.
+static void
+expect(int in, int out, const char * what, int type, const char * payload, int want_type, const char * want)
+{
+    send_frame(in, type, payload);
+    char * resp;
+    int got = recv_frame(out, &resp);
+    if (got != want_type) {
+        char msg[256];
+        snprintf(msg, sizeof(msg), "got response '%c', not '%c': %s", got ? got : '0', want_type, resp ? resp : "");
+        fail(what, msg);
+    } else if (want && !strstr(resp, want)) {
+        fail(what, "response lacks what it should have");
+    }
+    free(resp);
+}
+
+// whether the server has closed the connection
+static bool
+closed(int out)
+{
+    char c;
+    return read(out, &c, 1) == 0;
+}
+
+// a server on stdin and stdout, in a child; *in and *out are its ends
+static pid_t
+start_stdin_server(int * in, int * out)
+{
+    int to[2], from[2];
+    if (pipe(to) != 0 || pipe(from) != 0) {
+        perror("serve_test: pipe");
+        exit(EXIT_FAILURE);
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(to[0], STDIN_FILENO);
+        dup2(from[1], STDOUT_FILENO);
+        // the details of errors aren't wanted
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        close(to[0]); close(to[1]); close(from[0]); close(from[1]); close(null);
+        _exit(serve("-", false) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    close(to[0]);
+    close(from[1]);
+    *in = to[1];
+    *out = from[0];
+    return pid;
+}
+
+static void
+test_requests()
+{
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/a.c", dir);
+    FILE * f = fopen(path, "w");
+    fputs("#define N int\nN f();\n", f);
+    fclose(f);
+
+    int in, out;
+    pid_t pid = start_stdin_server(&in, &out);
+    expect(in, out, "'s' request", 's', "int x;\n", 'o', "IDENT (x)");
+    expect(in, out, "'f' request", 'f', path, 'o', "IDENT (f)");
+    expect(in, out, "missing file", 'f', "/nonexistent/a.c", 'e', NULL);
+    expect(in, out, "syntax error", 's', "int ;\n", 'e', NULL);
+    expect(in, out, "unknown type", 'x', "int x;\n", 'e', "unknown request type");
+
+    // typedefs and macros go with their request
+    expect(in, out, "typedef", 's', "typedef int T;\nT x;\n", 'o', "IDENT (x)");
+    expect(in, out, "typedef from the last request", 's', "T y;\n", 'e', NULL);
+    expect(in, out, "macro", 's', "#define M int\nM x;\n", 'o', "IDENT (x)");
+    expect(in, out, "macro from the last request", 's', "M y;\n", 'e', NULL);
+    expect(in, out, "macro from a file", 's', "N g();\n", 'e', NULL);
+    expect(in, out, "after errors", 's', "int z;\n", 'o', "IDENT (z)");
+
+    // a request that's too long gets an 'e', and the connection ends
+    send_header(in, 's', MAX_REQUEST + 1);
+    char * resp;
+    if (recv_frame(out, &resp) != 'e')
+        fail("request too long", "no 'e' response");
+    else if (!closed(out))
+        fail("request too long", "connection not closed");
+    free(resp);
+    close(in);
+    close(out);
+    waitpid(pid, NULL, 0);
+}
+
+// a frame cut off in its header or its payload ends the connection without
+// a response
+static void
+test_truncated(bool in_header)
+{
+    const char * what = in_header ? "truncated header" : "truncated payload";
+    int in, out;
+    pid_t pid = start_stdin_server(&in, &out);
+    expect(in, out, what, 's', "int x;\n", 'o', "IDENT (x)");
+    if (in_header) {
+        write_all(in, "s\0\0", 3);
+    } else {
+        send_header(in, 's', 100);
+        write_all(in, "int y;\n", 7);
+    }
+    close(in);
+    if (!closed(out))
+        fail(what, "got a response");
+    close(out);
+    int status;
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status))
+        fail(what, "server didn't exit");
+}
+
+static int
+connect_to(const char * path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strcpy(addr.sun_path, path);
+    for (int tries = 0; tries < 100; tries++) {
+        int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0)
+            return fd;
+        close(fd);
+        usleep(10000);
+    }
+    fail("socket", "can't connect");
+    return -1;
+}
+
+// on a socket, a connection that's closed for a request that's too long
+// leaves the server taking new ones
+static void
+test_socket()
+{
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/sock", dir);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        dup2(null, STDERR_FILENO);
+        _exit(serve(path, false) ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    int fd = connect_to(path);
+    if (fd >= 0) {
+        expect(fd, fd, "socket", 's', "typedef int T;\nT x;\n", 'o', "IDENT (x)");
+        send_header(fd, 's', MAX_REQUEST + 1);
+        char * resp;
+        if (recv_frame(fd, &resp) != 'e' || !closed(fd))
+            fail("socket request too long", "no 'e' and close");
+        free(resp);
+        close(fd);
+    }
+    fd = connect_to(path);
+    if (fd >= 0) {
+        expect(fd, fd, "socket after a closed connection", 's', "T y;\n", 'e', NULL);
+        expect(fd, fd, "socket after a closed connection", 's', "int y;\n", 'o', "IDENT (y)");
+        close(fd);
+    }
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(path);
+}
+
+int
+main()
+{
+    arena = arena_init_vm((size_t) 1 << 30, 0);
+    tokenizer_init();
+    signal(SIGPIPE, SIG_IGN);
+    if (!mkdtemp(dir)) {
+        perror("serve_test: mkdtemp");
+        return EXIT_FAILURE;
+    }
+
+    test_requests();
+    test_truncated(true);
+    test_truncated(false);
+    test_socket();
+
+    char path[sizeof(dir) + 16];
+    snprintf(path, sizeof(path), "%s/a.c", dir);
+    unlink(path);
+    rmdir(dir);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
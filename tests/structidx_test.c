@@ -0,0 +1,72 @@
+// Checks the 64-byte block scanner, with whichever prefix XOR this CPU
+// runs, against feeding the same text a byte at a time, which never takes
+// the block path.
+#include "structidx.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static const char * pieces[] = {
+    "int", "x", " ", "  ", "\t", "\n", "\n", "{", "}", "(", ")", ";", ",",
+    "\"str\"", "\"a\\\"b\"", "\"{(;\"", "'c'", "'\\''", "'\"'", "\"'\"",
+    "/* { ( ; */", "/*\n*/", "// { (\n", "#define X {\n", "#if 1\n",
+    "\\\n", "\\", "\\\\", "\"", "'", "/", "*", "**", "#",
+};
+
+static structidx_t
+scan_pieces(const char * text, size_t len, size_t max_piece)
+{
+    structidx_t ix = { 0 };
+    structidx_scan_t * sp = structidx_scan_new();
+    for (size_t i = 0; i < len; ) {
+        size_t n = 1 + (size_t) rand() % max_piece;
+        if (n > len - i)
+            n = len - i;
+        structidx_scan_feed(sp, text + i, n, &ix);
+        i += n;
+    }
+    structidx_scan_free(sp);
+    return ix;
+}
+
+static bool
+same(const structidx_t * a, const structidx_t * b)
+{
+    if (a->num_pos != b->num_pos)
+        return false;
+    for (size_t i = 0; i < a->num_pos; i++) {
+        struct_pos_t p = a->pos[i], q = b->pos[i];
+        if (p.off != q.off || p.depth != q.depth || p.c != q.c || p.after_paren != q.after_paren)
+            return false;
+    }
+    return true;
+}
+
+int
+main()
+{
+    size_t num_pieces = sizeof(pieces)/sizeof(*pieces);
+    char text[8192];
+    srand(1);
+    for (int round = 0; round < 2000; round++) {
+        size_t len = 0;
+        // long runs of plain code, so that blocks take the fast path
+        while (len < sizeof(text) - 64) {
+            const char * s = (rand() % 16) ? pieces[rand() % 13] : pieces[rand() % num_pieces];
+            size_t n = strlen(s);
+            memcpy(text + len, s, n);
+            len += n;
+        }
+        structidx_t whole = structidx_build(text, len);
+        structidx_t bytes = scan_pieces(text, len, 1);
+        structidx_t mixed = scan_pieces(text, len, 200);
+        if (!same(&whole, &bytes) || !same(&whole, &mixed)) {
+            fprintf(stderr, "structidx_test: round %d: block and byte scans differ on:\n%.*s\n", round, (int) len, text);
+            return 1;
+        }
+        structidx_free(&whole);
+        structidx_free(&bytes);
+        structidx_free(&mixed);
+    }
+    return 0;
+}
@@ -1,105 +1,756 @@
+#define _POSIX_C_SOURCE 200809L
 #include "tokenizer.h"
+#include "intern.h"
+#include "srcloc.h"
+#include "numlit.h"
+#include "strlit.h"
+#include "ptrmap.h"
+#include "punct_tables.h"   // generated
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include <ctype.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #define NELEMS(X) (sizeof(X)/sizeof(X[0]))
 #define NELEMSU(X) (int)(sizeof(X)/sizeof(X[0]))
 
-tokenizer_state_t tok_state = { 0, 1 };
-
-static token_t token_list[] = {
-
-    // extern char c;
-    { .typ = TOK_EXTERN,                },
-    { .typ = TOK_CHAR                   },
-    { .typ = TOK_IDENT, .u.c_s = "c"    },
-    { .typ = ';',                       },
-    { .typ = '\n',                      },
-
-    // static const signed char * const c;
-    { .typ = TOK_STATIC,                },
-    { .typ = TOK_CONST,                 },
-    { .typ = TOK_SIGNED                 },
-    { .typ = TOK_CHAR                   },
-    { .typ = '*'                        },
-    { .typ = TOK_CONST,                 },
-    { .typ = TOK_IDENT, .u.c_s = "c"    },
-    { .typ = ';',                       },
-    { .typ = '\n',                      },
-
-    // int x;
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "x"    },
-    { .typ = ';',                       },
-    { .typ = '\n',                      },
-
-    // int f();
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "f"    },
-    { .typ = '(',                       },
-    { .typ = ')',                       },
-    { .typ = ';',                       },
-    { .typ = '\n',                      },
-
-    // int f(int a);
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "f"    },
-    { .typ = '(',                       },
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "a"    },
-    { .typ = ')',                       },
-    { .typ = ';',                       },
-    { .typ = '\n',                      },
-
-    // const int * f(int a, const char * b);
-    { .typ = TOK_CONST,                 },
-    { .typ = TOK_INT,                   },
-    { .typ = '*',                       },
-    { .typ = TOK_IDENT, .u.c_s = "f"    },
-    { .typ = '(',                       },
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "a"    },
-    { .typ = ',',                       },
-    { .typ = TOK_CONST,                 },
-    { .typ = TOK_CHAR,                  },
-    { .typ = '*',                       },
-    { .typ = TOK_IDENT, .u.c_s = "b"    },
-    { .typ = ')',                       },
-    { .typ = ';',                       },
-    { .typ = '\n',                      },
-
-    // int f() { return 0; }
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "f"    },
-    { .typ = '(',                       },
-    { .typ = ')',                       },
-    { .typ = '{',                       },
-    { .typ = TOK_INT,                   },
-    { .typ = TOK_IDENT, .u.c_s = "x"    },
-    { .typ = ';',                       },
-    { .typ = TOK_RETURN,                },
-    { .typ = TOK_LITERAL_INT, .u.i = 0  },
-    { .typ = ';',                       },
-    { .typ = '}',                       },
-    { .typ = '\n',                      },
-
-    { .typ = TOK_EOF,                   },
+tokenizer_state_t tok_state = { 0 };
+
+// parsed when no files are given
+static const char builtin_src[] =
+    "extern char c;\n"
+    "static const signed char * const c;\n"
+    "int x;\n"
+    "int f();\n"
+    "int f(int a);\n"
+    "const int * f(int a, const char * b);\n"
+    "typedef const char * str_t;\n"
+    "str_t g(str_t s);\n"
+    "int f() { int x; return 0; }\n";
+
+static token_t eof_token = { .typ = TOK_EOF };
+
+// the token stream that get_token() and peek_token() read from
+#if TOKENS_PACKED
+// 8-bit kind and 32-bit location. Kinds below 128 are characters; TOK_*
+// values are stored as 128 + (typ - TOK_EOF). Only identifiers and literals
+// have a value and flags, which are kept in side tables holding just those
+// tokens' and found from the other 24 bits of the first word.
+typedef struct {
+    uint32_t kind : 8;
+    uint32_t val : 24;  // side table index, less val_base[] for its block
+    uint32_t loc;
+} packed_token_t;
+
+// every TOK_* value has to fit in a kind
+typedef char packed_kinds_fit[TOK_INVALID - TOK_EOF < 128 ? 1 : -1];
+
+// a block of tokens has fewer values than fit in val
+#define VAL_BLOCK_BITS  24
+
+static packed_token_t packed_eof = { .kind = 128 };
+static packed_token_t * tokens = &packed_eof;
+static int tokens_cap;
+static token_value_t * token_vals;     // side tables
+static uint16_t * token_flags;
+static int vals_cap;
+static uint32_t * val_base;            // side table index of each block's first
+static int val_base_cap;
+#else
+static token_t * tokens = &eof_token;
+#endif
+static int num_tokens = 1;
+
+typedef struct {
+    const char * s;
+    token_type_t typ;
+} keyword_t;
+
+static keyword_t keywords[] = {
+    { "if",         TOK_IF          },
+    { "else",       TOK_ELSE        },
+    { "do",         TOK_DO          },
+    { "while",      TOK_WHILE       },
+    { "for",        TOK_FOR         },
+    { "switch",     TOK_SWITCH      },
+    { "case",       TOK_CASE        },
+    { "break",      TOK_BREAK       },
+    { "continue",   TOK_CONTINUE    },
+    { "default",    TOK_DEFAULT     },
+    { "return",     TOK_RETURN      },
+    { "goto",       TOK_GOTO        },
+    { "typedef",    TOK_TYPEDEF     },
+    { "struct",     TOK_STRUCT      },
+    { "union",      TOK_UNION       },
+    { "enum",       TOK_ENUM        },
+    { "signed",     TOK_SIGNED      },
+    { "unsigned",   TOK_UNSIGNED    },
+    { "void",       TOK_VOID        },
+    { "int",        TOK_INT         },
+    { "char",       TOK_CHAR        },
+    { "long",       TOK_LONG        },
+    { "short",      TOK_SHORT       },
+    { "float",      TOK_FLOAT       },
+    { "double",     TOK_DOUBLE      },
+    { "const",      TOK_CONST       },
+    { "static",     TOK_STATIC      },
+    { "extern",     TOK_EXTERN      },
+    { "auto",       TOK_AUTO        },
+    { "volatile",   TOK_VOLATILE    },
+    { "register",   TOK_REGISTER    },
+    { "restrict",   TOK_RESTRICT    },
+    { "inline",     TOK_INLINE      },
+    { "sizeof",     TOK_SIZEOF      },
 };
 
+// interned spelling -> token_type_t
+static ptrmap_t kw_map;
+
+static const char * include_str;
+
+static token_type_t
+keyword_type(const char * s)
+{
+    token_type_t typ = (token_type_t)(uintptr_t) ptrmap_get(&kw_map, s);
+    return typ ? typ : TOK_IDENT;
+}
+
+void
+tokenizer_init()
+{
+    for (int i = 0; i < NELEMSU(keywords); i++) {
+        const char * s = intern_cstr(keywords[i].s);
+        ptrmap_put(&kw_map, s, (void *)(uintptr_t) keywords[i].typ);
+    }
+    include_str = intern_cstr("include");
+
+    // the parser doesn't want newlines
+    token_t * toks;
+    uint32_t base = srcloc_add_file("<builtin>", builtin_src, sizeof(builtin_src)-1);
+    int n = lex(builtin_src, sizeof(builtin_src)-1, base, &toks);
+    int j = 0;
+    for (int i = 0; i < n; i++) {
+        if (toks[i].typ != '\n')
+            toks[j++] = toks[i];
+    }
+    tokenizer_set_tokens(toks, j);
+}
+
+#if TOKENS_PACKED
+static int
+typ_to_kind(int typ)
+{
+    return typ < 256 ? typ : 128 + (typ - TOK_EOF);
+}
+
+static int
+kind_to_typ(int kind)
+{
+    return kind < 128 ? kind : TOK_EOF + (kind - 128);
+}
+
+static bool
+kind_has_value(int kind)
+{
+    int typ = kind_to_typ(kind);
+    return typ == TOK_IDENT ||
+           typ == TOK_LITERAL_INT ||
+           typ == TOK_LITERAL_FLOAT ||
+           typ == TOK_LITERAL_CHAR ||
+           typ == TOK_LITERAL_STRING;
+}
+
+static token_t
+unpack(int idx)
+{
+    packed_token_t pt = tokens[idx];
+    int kind = pt.kind;
+    token_t t = { .typ = kind_to_typ(kind), .loc = pt.loc };
+    if (kind_has_value(kind)) {
+        uint32_t v = val_base[idx >> VAL_BLOCK_BITS] + pt.val;
+        t.u = token_vals[v];
+        t.flags = token_flags[v];
+    }
+    return t;
+}
+#endif
+
+void
+tokenizer_set_tokens(token_t * toks, int num_toks)
+{
+#if TOKENS_PACKED
+    int num_vals = 0;
+    for (int i = 0; i < num_toks; i++) {
+        num_vals += kind_has_value(typ_to_kind(toks[i].typ));
+    }
+    int num_blocks = (num_toks >> VAL_BLOCK_BITS) + 1;
+    if (num_toks > tokens_cap) {
+        if (tokens != &packed_eof)
+            free(tokens);
+        tokens_cap = num_toks;
+        tokens = malloc(sizeof(*tokens)*tokens_cap);
+        assert(tokens);
+    }
+    if (num_vals > vals_cap) {
+        free(token_vals);
+        free(token_flags);
+        vals_cap = num_vals;
+        token_vals = malloc(sizeof(*token_vals)*vals_cap);
+        token_flags = malloc(sizeof(*token_flags)*vals_cap);
+        assert(token_vals && token_flags);
+    }
+    if (num_blocks > val_base_cap) {
+        free(val_base);
+        val_base_cap = num_blocks;
+        val_base = malloc(sizeof(*val_base)*val_base_cap);
+        assert(val_base);
+    }
+    uint32_t v = 0;
+    for (int i = 0; i < num_toks; i++) {
+        if ((i & ((1 << VAL_BLOCK_BITS) - 1)) == 0)
+            val_base[i >> VAL_BLOCK_BITS] = v;
+        int kind = typ_to_kind(toks[i].typ);
+        tokens[i] = (packed_token_t) { .kind = (uint32_t) kind, .loc = toks[i].loc };
+        if (kind_has_value(kind)) {
+            tokens[i].val = v - val_base[i >> VAL_BLOCK_BITS];
+            token_vals[v] = toks[i].u;
+            token_flags[v] = toks[i].flags;
+            v++;
+        }
+    }
+#else
+    tokens = toks;
+#endif
+    num_tokens = num_toks;
+    tok_state = (tokenizer_state_t) { 0 };
+}
+
+typedef struct {
+    token_t * toks;
+    int num_toks;
+    int cap;
+} tok_buf_t;
+
+static void
+push_token(tok_buf_t * bp, token_t t)
+{
+    if (bp->num_toks >= bp->cap) {
+        bp->cap = bp->cap ? bp->cap*2 : 1024;
+        bp->toks = realloc(bp->toks, sizeof(*bp->toks)*bp->cap);
+        assert(bp->toks);
+    }
+    bp->toks[bp->num_toks++] = t;
+}
+
+static bool
+is_ident_char(char c)
+{
+    return char_class[(unsigned char) c] & CC_IDENT;
+}
+
+// returns a pointer just past the closing quote, or NULL if unterminated;
+// sets TF_ESCAPE in *flags if there's a backslash on the way
+static const char *
+scan_quoted(const char * p, const char * end, char quote, uint16_t * flags)
+{
+    // most literals have no escapes, so let memchr() do the work
+    const char * q = memchr(p+1, quote, end - (p+1));
+    if (q && !memchr(p+1, '\\', q - (p+1)) && !memchr(p+1, '\n', q - (p+1)))
+        return q+1;
+    for (p++; p < end; p++) {
+        if (*p == '\\' && p+1 < end) {
+            *flags |= TF_ESCAPE;
+            p++;
+        } else if (*p == quote) {
+            return p+1;
+        } else if (*p == '\n') {
+            return NULL;
+        }
+    }
+    return NULL;
+}
+
+// longest punctuator at p; sets *len. Always PUNCT_MAX_LEN table lookups,
+// see tools/gen_punct.c.
+static token_type_t
+lex_punct(const char * p, const char * end, int * len)
+{
+    unsigned s = 0;
+    for (int i = 0; i < PUNCT_MAX_LEN; i++) {
+        unsigned char c = p+i < end ? p[i] : '\0';
+        s = punct_next[s][punct_col[c]];
+    }
+    *len = punct_len[s];
+    return punct_typ[s];
+}
+
+static const char * punct_strs[] = {
+#define P(A, S) [TOK_ ## A] = S,
+    TOK_PUNCTS
+#undef P
+};
+
+// Write the spelling of t to buf, truncating to fit. Returns the length of
+// the untruncated spelling.
+size_t
+token_spell(token_t t, char * buf, size_t sz)
+{
+    int n;
+    size_t avail, len;
+    const char * text = srcloc_text(t.loc, &avail);
+    if (t.typ < 256) {
+        n = snprintf(buf, sz, "%c", t.typ);
+    } else if (t.typ == TOK_LITERAL_INT || t.typ == TOK_LITERAL_FLOAT) {
+        // numbers only keep their value, so go back to the source; macro
+        // expansions are located at their invocation, hence the check
+        token_t src = { .flags = t.flags };
+        len = text ? numlit_len(text, text + avail) : 0;
+        if (len > 0)
+            numlit_decode(text, text + len, &src);
+        if (len > 0 && src.typ == t.typ && ((src.flags ^ t.flags) & TF_NUM_MASK) == 0 && memcmp(&src.u, &t.u, sizeof(t.u)) == 0) {
+            n = snprintf(buf, sz, "%.*s", (int) len, text);
+        } else {
+            const char * sfx = (t.flags & TF_NUM_F) ? "f" : (t.flags & TF_NUM_LL) ? "ll" : (t.flags & TF_NUM_L) ? "l" : "";
+            if (t.typ == TOK_LITERAL_FLOAT)
+                n = snprintf(buf, sz, "%a%s", t.u.d, sfx);
+            else
+                n = snprintf(buf, sz, "%llu%s%s", (unsigned long long) t.u.i, (t.flags & TF_NUM_U) ? "u" : "", sfx);
+        }
+    } else if (t.typ < NELEMSU(punct_strs) && punct_strs[t.typ]) {
+        n = snprintf(buf, sz, "%s", punct_strs[t.typ]);
+    } else if (t.typ == TOK_LITERAL_STRING || t.typ == TOK_LITERAL_CHAR) {
+        n = (int) strlit_spell(t, buf, sz);
+    } else if (t.u.c_s) {
+        // identifiers, keywords and other literals keep their spelling
+        n = snprintf(buf, sz, "%s", t.u.c_s);
+    } else {
+        n = snprintf(buf, sz, "%s", "");
+    }
+    return (size_t) n;
+}
+
+// Lexer state at a chunk boundary. Chunks start just past a newline that
+// isn't spliced, so lexing resumes either at the start of a line or inside
+// a block comment that crossed it: no other token can span that newline.
+typedef struct {
+    bool in_comment;
+    bool in_directive;
+    bool in_include;    // after '#include', so '<' starts a header name
+    bool bol;           // no token yet on this line
+} lex_state_t;
+
+static const lex_state_t line_start = { .bol = true };
+
+// Skip the inside of a block comment from p, keeping its newlines for line
+// counting except where they would end a directive early. Returns a pointer
+// past the "*/", or NULL if the comment doesn't end before end.
+static const char *
+skip_comment(const char * src, const char * p, const char * end, uint32_t base, bool in_directive, tok_buf_t * bp)
+{
+    for (; p < end; p++) {
+        if (p[0] == '*' && p+1 < end && p[1] == '/')
+            return p+2;
+        if (*p == '\n' && !in_directive)
+            push_token(bp, (token_t) { .typ = '\n', .flags = TF_IN_COMMENT, .loc = base + (uint32_t)(p - src) });
+    }
+    return NULL;
+}
+
+// index of the newline token at loc in bp that isn't inside a comment, or -1
+static int
+find_line_end(const tok_buf_t * bp, uint32_t loc)
+{
+    int lo = 0, hi = bp->num_toks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo)/2;
+        if (bp->toks[mid].loc < loc)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if (lo < bp->num_toks && bp->toks[lo].loc == loc &&
+        bp->toks[lo].typ == '\n' && !(bp->toks[lo].flags & TF_IN_COMMENT))
+        return lo;
+    return -1;
+}
+
+// Lex src[from, to) into bp, starting in state *st and leaving the state at
+// `to` there. `to` is the end of the buffer or just past an unspliced
+// newline. Safe to run on several threads at once.
+// If join is given, stop at the first line end that join also has, and set
+// *join_idx to its index there: from that point on, the two agree.
+static void
+lex_range(const char * src, size_t from, size_t to, size_t len, uint32_t base,
+          lex_state_t * st, tok_buf_t * bp, const tok_buf_t * join, int * join_idx)
+{
+    const char * p = src + from,
+               * end = src + to;
+    int flags = 0;
+    bool bol = st->bol;
+    bool in_directive = st->in_directive;
+    bool in_include = st->in_include;
+
+    if (st->in_comment) {
+        p = skip_comment(src, p, end, base, in_directive, bp);
+        if (!p) {
+            if (to == len)
+                push_token(bp, (token_t) { .typ = TOK_INVALID, .loc = base + (uint32_t) from });
+            return;
+        }
+        flags |= TF_SPACE;
+    }
+
+    while (p < end) {
+        char c = *p;
+        if (char_class[(unsigned char) c] & CC_SPACE) {
+            p++;
+            flags |= TF_SPACE;
+            continue;
+        }
+        // line splice
+        // TODO: splices inside of identifiers and numbers
+        if (c == '\\' && p+1 < end && (p[1] == '\n' || (p[1] == '\r' && p+2 < end && p[2] == '\n'))) {
+            p += (p[1] == '\n') ? 2 : 3;
+            flags |= TF_SPACE;
+            continue;
+        }
+        if (c == '\n') {
+            uint32_t loc = base + (uint32_t)(p - src);
+            if (join && (*join_idx = find_line_end(join, loc)) >= 0) {
+                *st = line_start;
+                return;
+            }
+            push_token(bp, (token_t) { .typ = '\n', .loc = loc });
+            p++;
+            flags = 0;
+            bol = true;
+            in_directive = in_include = false;
+            continue;
+        }
+        if (c == '/' && p+1 < end && p[1] == '*') {
+            const char * q = skip_comment(src, p+2, end, base, in_directive, bp);
+            if (!q && to == len) {
+                push_token(bp, (token_t) { .typ = TOK_INVALID, .flags = flags, .loc = base + (uint32_t)(p - src) });
+                break;
+            }
+            if (!q) {
+                *st = (lex_state_t) { .in_comment = true, .in_directive = in_directive, .in_include = in_include, .bol = bol };
+                return;
+            }
+            p = q;
+            flags |= TF_SPACE;
+            continue;
+        }
+        if (c == '/' && p+1 < end && p[1] == '/') {
+            while (p < end && *p != '\n') {
+                p++;
+            }
+            flags |= TF_SPACE;
+            continue;
+        }
+
+        token_t t = { .typ = TOK_INVALID, .flags = flags, .loc = base + (uint32_t)(p - src) };
+        const char * start = p;
+        flags = 0;
+
+        // character and string literals, with optional encoding prefix
+        const char * q = p;
+        if (*q == 'u' && q+1 < end && q[1] == '8')
+            q += 2;
+        else if (*q == 'L' || *q == 'u' || *q == 'U')
+            q++;
+        if (q < end && (*q == '"' || *q == '\'')) {
+            p = scan_quoted(q, end, *q, &t.flags);
+            if (!p) {
+                p = q+1;
+                while (p < end && *p != '\n') {
+                    p++;
+                }
+                t.u.c_s = intern(start, p - start);
+            } else {
+                // points into the source; see strlit.h
+                t.typ = (*q == '"') ? TOK_LITERAL_STRING : TOK_LITERAL_CHAR;
+                t.u.c_s = start;
+            }
+        } else if (in_include && c == '<') {
+            // header name
+            while (p < end && *p != '>' && *p != '\n') {
+                p++;
+            }
+            if (p < end && *p == '>') {
+                p++;
+                t.typ = TOK_LITERAL_STRING;
+                t.u.c_s = start;
+            } else {
+                t.u.c_s = intern(start, p - start);
+            }
+        } else if ((char_class[(unsigned char) c] & (CC_IDENT | CC_DIGIT)) == CC_IDENT) {
+            while (p < end && is_ident_char(*p)) {
+                p++;
+            }
+            t.u.c_s = intern(start, p - start);
+            t.typ = keyword_type(t.u.c_s);
+        } else if ((char_class[(unsigned char) c] & CC_DIGIT) || (c == '.' && p+1 < end && (char_class[(unsigned char) p[1]] & CC_DIGIT))) {
+            p = start + numlit_len(start, end);
+            numlit_decode(start, p, &t);
+        } else {
+            int n;
+            t.typ = lex_punct(p, end, &n);
+            p += n;
+        }
+
+        if (bol && t.typ == '#') {
+            in_directive = true;
+        } else if (in_directive && bp->num_toks > 0 && bp->toks[bp->num_toks-1].typ == '#' && t.typ == TOK_IDENT &&
+                   t.u.c_s == include_str) {
+            in_include = true;
+        }
+        bol = false;
+        push_token(bp, t);
+    }
+    *st = (lex_state_t) { .in_directive = in_directive, .in_include = in_include, .bol = bol };
+}
+
+// Big files are split into chunks that are lexed on their own threads.
+// Each chunk after the first is lexed twice: once as if it started at the
+// start of a line, and once as if it started inside a block comment, and
+// the right one is picked when the previous chunk's end state is known. The
+// comment guess stops as soon as it reaches a line end the first guess also
+// has, since from there on they agree.
+#define LEX_CHUNK_MIN   (1 << 20)   // smaller chunks aren't worth a thread
+
+static int lex_threads;     // 0 means one per online CPU
+
+typedef struct {
+    const char * src;
+    size_t from, to, len;
+    uint32_t base;
+    tok_buf_t line;         // started at the start of a line
+    lex_state_t line_end;
+    tok_buf_t comment;      // started inside a block comment...
+    lex_state_t comment_end;
+    int join;               // ...followed by line.toks[join..], if join >= 0
+    bool comment_done;      // false if the guess was never needed
+} lex_chunk_t;
+
+// the state the comment guess assumes
+static const lex_state_t comment_start = { .in_comment = true, .bol = true };
+
+static bool
+state_eq(lex_state_t a, lex_state_t b)
+{
+    return a.in_comment == b.in_comment && a.in_directive == b.in_directive &&
+           a.in_include == b.in_include && a.bol == b.bol;
+}
+
+static bool
+has_comment_end(const char * p, const char * end)
+{
+    while ((p = memchr(p, '*', end - p)) != NULL && p+1 < end) {
+        if (p[1] == '/')
+            return true;
+        p++;
+    }
+    return false;
+}
+
+static void *
+lex_chunk(void * arg)
+{
+    lex_chunk_t * cp = arg;
+    cp->line_end = line_start;
+    lex_range(cp->src, cp->from, cp->to, cp->len, cp->base, &cp->line_end, &cp->line, NULL, NULL);
+    // a chunk with no "*/" can't be guessed cheaply, and if a comment does
+    // run into it, it's all comment and quick to relex
+    if (cp->from > 0 && has_comment_end(cp->src + cp->from, cp->src + cp->to)) {
+        cp->comment_end = comment_start;
+        cp->join = -1;
+        lex_range(cp->src, cp->from, cp->to, cp->len, cp->base, &cp->comment_end, &cp->comment, &cp->line, &cp->join);
+        if (cp->join >= 0)
+            cp->comment_end = cp->line_end;
+        cp->comment_done = true;
+    }
+    return NULL;
+}
+
+// start of the line that follows pos, skipping spliced newlines, or len
+static size_t
+next_line_start(const char * src, size_t pos, size_t len)
+{
+    for (;;) {
+        // a long line can carry the previous chunk past where this one
+        // was meant to end
+        if (pos >= len)
+            return len;
+        const char * nl = memchr(src + pos, '\n', len - pos);
+        if (!nl)
+            return len;
+        pos = nl - src + 1;
+        if (nl > src && nl[-1] == '\\')
+            continue;
+        if (nl > src+1 && nl[-1] == '\r' && nl[-2] == '\\')
+            continue;
+        return pos;
+    }
+}
+
+static int
+lex_parallel(const char * src, size_t len, uint32_t base, int num_chunks, token_t ** toks)
+{
+    lex_chunk_t * chunks = calloc(num_chunks, sizeof(*chunks));
+    pthread_t * threads = calloc(num_chunks, sizeof(*threads));
+    assert(chunks && threads);
+    int n = 0;
+    for (size_t from = 0; from < len; n++) {
+        size_t to = (n == num_chunks-1) ? len : next_line_start(src, from + len/num_chunks, len);
+        assert(to > from);
+        chunks[n] = (lex_chunk_t) { .src = src, .from = from, .to = to, .len = len, .base = base };
+        from = to;
+    }
+
+    numlit_init();
+    for (int i = 1; i < n; i++) {
+        int err = pthread_create(&threads[i], NULL, lex_chunk, &chunks[i]);
+        assert(!err && "pthread_create");
+    }
+    lex_chunk(&chunks[0]);
+    for (int i = 1; i < n; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    // pick each chunk's guess in order, relexing in the rare case that
+    // neither matches, and stitch them together
+    tok_buf_t buf = { 0 };
+    lex_state_t st = line_start;
+    for (int i = 0; i < n; i++) {
+        lex_chunk_t * cp = &chunks[i];
+        const tok_buf_t * prefix = NULL;
+        const tok_buf_t * rest = &cp->line;
+        int rest_from = 0;
+        tok_buf_t redo = { 0 };
+        if (state_eq(st, line_start)) {
+            st = cp->line_end;
+        } else if (state_eq(st, comment_start) && cp->comment_done) {
+            prefix = &cp->comment;
+            if (cp->join >= 0)
+                rest_from = cp->join;
+            else
+                rest = NULL;
+            st = cp->comment_end;
+        } else {
+            lex_range(src, cp->from, cp->to, len, base, &st, &redo, NULL, NULL);
+            prefix = &redo;
+            rest = NULL;
+        }
+        if (prefix) {
+            for (int j = 0; j < prefix->num_toks; j++) {
+                push_token(&buf, prefix->toks[j]);
+            }
+        }
+        if (rest) {
+            for (int j = rest_from; j < rest->num_toks; j++) {
+                push_token(&buf, rest->toks[j]);
+            }
+        }
+        free(redo.toks);
+        free(cp->line.toks);
+        free(cp->comment.toks);
+    }
+    free(chunks);
+    free(threads);
+
+    push_token(&buf, (token_t) { .typ = TOK_EOF, .loc = base + (uint32_t) len });
+    *toks = buf.toks;
+    return buf.num_toks;
+}
+
+void
+tokenizer_set_threads(int n)
+{
+    lex_threads = n;
+}
+
+// Lex a whole buffer into a malloc'd token array terminated by TOK_EOF.
+// Newlines are kept as '\n' tokens since the preprocessor needs them. Token
+// locations are offsets from base. Returns the number of tokens, including
+// the TOK_EOF.
+int
+lex(const char * src, size_t len, uint32_t base, token_t ** toks)
+{
+    int num_chunks = (int) (len / LEX_CHUNK_MIN);
+    if (num_chunks > 1) {
+        // not asked for otherwise, since small inputs come by the million
+        // from push_parser_feed()
+        int threads = lex_threads > 0 ? lex_threads : (int) sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_chunks > threads)
+            num_chunks = threads;
+    }
+    if (num_chunks > 1)
+        return lex_parallel(src, len, base, num_chunks, toks);
+
+    tok_buf_t buf = { 0 };
+    lex_state_t st = line_start;
+    lex_range(src, 0, len, len, base, &st, &buf, NULL, NULL);
+    push_token(&buf, (token_t) { .typ = TOK_EOF, .loc = base + (uint32_t) len });
+    *toks = buf.toks;
+    return buf.num_toks;
+}
+
+// Lex part of a buffer as lex() would lex it along with the rest: from
+// src[from], the start of a line outside any comment, up to the first such
+// line start at least min_len bytes on, or the end. Sets *to to where it
+// stopped; the TOK_EOF is located there.
+int
+lex_lines(const char * src, size_t from, size_t min_len, size_t len, uint32_t base, token_t ** toks, size_t * to)
+{
+    tok_buf_t buf = { 0 };
+    lex_state_t st = line_start;
+    size_t end = next_line_start(src, from + min_len, len);
+    lex_range(src, from, end, len, base, &st, &buf, NULL, NULL);
+    // a comment can't be cut, so take lines until it ends
+    while (st.in_comment && end < len) {
+        size_t next = next_line_start(src, end, len);
+        lex_range(src, end, next, len, base, &st, &buf, NULL, NULL);
+        end = next;
+    }
+    push_token(&buf, (token_t) { .typ = TOK_EOF, .loc = base + (uint32_t) end });
+    *toks = buf.toks;
+    *to = end;
+    return buf.num_toks;
+}
+
 token_t
 peek_token(int n)
 {
-    token_t t;
-    int peek_idx = tok_state.token_idx;
-    for (int i = 0; i <= n; i++) {
-        do {
-            t = token_list[peek_idx++];
-            if (t.typ == TOK_EOF) {
-                return t;
-            }
-        } while (t.typ == '\n');
+    int peek_idx = tok_state.token_idx + n;
+    if (peek_idx >= num_tokens) {
+        peek_idx = num_tokens-1;
     }
-    return t;
+#if TOKENS_PACKED
+    return unpack(peek_idx);
+#else
+    return tokens[peek_idx];
+#endif
+}
+
+// type of the token peek_token(n) would return, without fetching its value
+int
+peek_typ(int n)
+{
+    int peek_idx = tok_state.token_idx + n;
+    if (peek_idx >= num_tokens) {
+        peek_idx = num_tokens-1;
+    }
+#if TOKENS_PACKED
+    return kind_to_typ(tokens[peek_idx].kind);
+#else
+    return tokens[peek_idx].typ;
+#endif
 }
 
 #define X(A) [TOK_ ## A] = #A,
@@ -112,30 +763,39 @@ token_t
 get_token()
 {
     token_t t;
-    if (tok_state.token_idx >= NELEMSU(token_list)) {
-        return (token_t) { .typ = TOK_EOF };
+    int idx = tok_state.token_idx;
+    if (idx >= num_tokens) {
+        idx = num_tokens-1;
+    } else {
+        tok_state.token_idx++;
     }
-    do {
-        t = token_list[tok_state.token_idx++];
+#if TOKENS_PACKED
+    t = unpack(idx);
+#else
+    t = tokens[idx];
+#endif
 #if 0
-        const char * enum_str = tok_enum_strs[t.typ];
-        if (enum_str == NULL) {
-            if (isprint(t.typ))
-                fprintf(stderr, " '%c'", t.typ);
-            else
-                fprintf(stderr, " %d", t.typ);
-        } else {
-            fprintf(stderr, " %s", enum_str);
-        }
-        fprintf(stderr, "\n");
+    const char * enum_str = tok_enum_strs[t.typ];
+    if (enum_str == NULL) {
+        if (isprint(t.typ))
+            fprintf(stderr, " '%c'", t.typ);
+        else
+            fprintf(stderr, " %d", t.typ);
+    } else {
+        fprintf(stderr, " %s", enum_str);
+    }
+    fprintf(stderr, "\n");
 #endif
-        if (t.typ == '\n') {
-            tok_state.line_num++;
-        }
-    } while (t.typ == '\n');
     return t;
 }
 
+// location of the next token in state st
+uint32_t
+token_loc(tokenizer_state_t st)
+{
+    return tokens[st.token_idx < num_tokens ? st.token_idx : num_tokens-1].loc;
+}
+
 // TODO: unget newline
 #if 0
 static void
@@ -143,7 +803,7 @@ unget_token()
 {
     tok_state.token_idx--;
 #if 1
-    int c = token_list[tok_state.token_idx].typ;
+    int c = tokens[tok_state.token_idx].typ;
     const char * enum_str = tok_enum_strs[c];
     if (enum_str == NULL) {
         if (isprint(c))
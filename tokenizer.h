@@ -1,6 +1,9 @@
 #ifndef TOKENIZER_H
 #define TOKENIZER_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define TOK_ENUMS       \
     X(IF)               \
     X(ELSE)             \
@@ -64,8 +67,41 @@
     X(XOR_EQ)           \
     X(SH_LEFT_EQ)       \
     X(SH_RIGHT_EQ)      \
+    X(ELLIPSIS)         \
+    X(HASHHASH)         \
     X(INVALID)
 
+// Multi-character punctuators and their spellings. tools/gen_punct.c builds
+// the lexer's maximal munch tables from this list and PUNCT_CHARS at build
+// time, so a new operator only needs its TOK_ENUMS entry and a line here.
+#define TOK_PUNCTS                  \
+    P(PRE_INCR,     "++")           \
+    P(PRE_DEC,      "--")           \
+    P(ARROW,        "->")           \
+    P(SH_LEFT,      "<<")           \
+    P(SH_RIGHT,     ">>")           \
+    P(LTE,          "<=")           \
+    P(GTE,          ">=")           \
+    P(EQ,           "==")           \
+    P(NE,           "!=")           \
+    P(LOG_AND,      "&&")           \
+    P(LOG_OR,       "||")           \
+    P(PLUS_EQ,      "+=")           \
+    P(MINUS_EQ,     "-=")           \
+    P(TIMES_EQ,     "*=")           \
+    P(DIV_EQ,       "/=")           \
+    P(MOD_EQ,       "%=")           \
+    P(AND_EQ,       "&=")           \
+    P(OR_EQ,        "|=")           \
+    P(XOR_EQ,       "^=")           \
+    P(SH_LEFT_EQ,   "<<=")          \
+    P(SH_RIGHT_EQ,  ">>=")          \
+    P(ELLIPSIS,     "...")          \
+    P(HASHHASH,     "##")
+
+// single-character punctuators, whose token type is the character itself
+#define PUNCT_CHARS "+-*/%^=!#&|<>.()[]{};,?:~"
+
 // TODO: merge token_type_t and ast_node_type_t?
 #define X(A) TOK_ ## A,
 typedef enum {
@@ -74,24 +110,62 @@ typedef enum {
 } token_type_t;
 #undef X
 
+// token flags
+enum {
+    TF_SPACE    = 1 << 0,   // preceded by whitespace
+    TF_NOEXPAND = 1 << 1,   // names a macro that must not be expanded
+    // numeric literals
+    TF_NUM_U        = 1 << 2,   // u suffix
+    TF_NUM_L        = 1 << 3,   // l suffix, on an integer or a float
+    TF_NUM_LL       = 1 << 4,   // ll suffix
+    TF_NUM_F        = 1 << 5,   // f suffix
+    TF_NUM_OVERFLOW = 1 << 6,   // doesn't fit in 64 bits
+    TF_NUM_INVALID  = 1 << 7,   // a pp-number that isn't a valid literal
+    TF_NUM_DECIMAL  = 1 << 10,  // an integer written in decimal
+    TF_NUM_MASK     = 0x4fc,
+    // string and character literals
+    TF_ESCAPE       = 1 << 8,   // has a backslash; see strlit.h
+    // newlines
+    TF_IN_COMMENT   = 1 << 9,   // inside a block comment
+};
+
 // TODO: determine if pointer is in the heap or .rodata
+typedef union {
+    const char * c_s;
+    char * s;
+    uint64_t i;         // TOK_LITERAL_INT
+    double d;           // TOK_LITERAL_FLOAT
+} token_value_t;
+
 typedef struct {
-    token_type_t typ;
-    union {
-        const char * c_s;
-        char * s;
-        int i;
-    } u;
+    uint16_t typ;       // token_type_t
+    uint16_t flags;
+    uint32_t loc;       // see srcloc.h
+    token_value_t u;
 } token_t;
 
+// When set, the token stream the parser reads is stored as 8-byte packed
+// tokens, with identifier and literal values kept in a side table that is
+// only read when a token with a value is fetched.
+#ifndef TOKENS_PACKED
+#define TOKENS_PACKED 1
+#endif
+
 typedef struct {
     int token_idx;
-    int line_num;
 } tokenizer_state_t;
 
 extern tokenizer_state_t tok_state;
 
+void tokenizer_init();
+void tokenizer_set_tokens(token_t * toks, int num_toks);
+int lex(const char * src, size_t len, uint32_t base, token_t ** toks);
+int lex_lines(const char * src, size_t from, size_t min_len, size_t len, uint32_t base, token_t ** toks, size_t * to);
+void tokenizer_set_threads(int n);
+size_t token_spell(token_t t, char * buf, size_t sz);
 token_t peek_token(int n);
+int peek_typ(int n);
 token_t get_token();
+uint32_t token_loc(tokenizer_state_t st);
 
 #endif /* TOKENIZER_H */
@@ -0,0 +1,159 @@
+// Writes the lexer's character-class and punctuator tables to stdout, from
+// TOK_PUNCTS and PUNCT_CHARS in tokenizer.h.
+//
+// The punctuator table is a DFA over the trie of all spellings. Every state
+// carries the longest punctuator that is a prefix of the input read so far,
+// and a state with nowhere to go moves to a sink that keeps its answer. The
+// lexer can then always make PUNCT_MAX_LEN lookups and read the result off
+// the final state, with no data-dependent branches.
+
+#include "tokenizer.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+typedef struct {
+    int typ;
+    const char * s;
+} punct_t;
+
+#define P(A, S) { TOK_ ## A, S },
+static const punct_t puncts[] = {
+    TOK_PUNCTS
+};
+#undef P
+
+#define NELEMS(X) (sizeof(X)/sizeof(X[0]))
+#define MAX_NODES 128
+
+static int child[MAX_NODES][256];   // trie; 0 is "none" since the root is never a child
+static int node_typ[MAX_NODES];     // punctuator spelled by the path here, or 0
+static int best_typ[MAX_NODES];     // longest punctuator along the path here
+static int best_len[MAX_NODES];
+static int depth[MAX_NODES];
+static int num_nodes = 1;
+
+static void
+insert(const char * s, int typ)
+{
+    int n = 0;
+    for (; *s; s++) {
+        int c = (unsigned char) *s;
+        if (!child[n][c]) {
+            assert(num_nodes < MAX_NODES);
+            child[n][c] = num_nodes++;
+        }
+        n = child[n][c];
+    }
+    assert(!node_typ[n] && "duplicate punctuator");
+    node_typ[n] = typ;
+}
+
+// parents come before children, so one pass in node order is enough
+static void
+fill_best()
+{
+    best_typ[0] = TOK_INVALID;
+    best_len[0] = 1;
+    for (int n = 0; n < num_nodes; n++) {
+        for (int c = 0; c < 256; c++) {
+            int m = child[n][c];
+            if (!m)
+                continue;
+            depth[m] = depth[n] + 1;
+            best_typ[m] = node_typ[m] ? node_typ[m] : best_typ[n];
+            best_len[m] = node_typ[m] ? depth[m] : best_len[n];
+        }
+    }
+}
+
+static void
+print_table(const char * decl, const int * v, int n)
+{
+    printf("%s = {", decl);
+    for (int i = 0; i < n; i++) {
+        printf("%s%d,", i % 16 ? " " : "\n    ", v[i]);
+    }
+    printf("\n};\n\n");
+}
+
+int
+main()
+{
+    int max_len = 1;
+    for (const char * s = PUNCT_CHARS; *s; s++) {
+        insert((char[]) { *s, '\0' }, *s);
+    }
+    for (size_t i = 0; i < NELEMS(puncts); i++) {
+        insert(puncts[i].s, puncts[i].typ);
+        if ((int) strlen(puncts[i].s) > max_len)
+            max_len = (int) strlen(puncts[i].s);
+    }
+    fill_best();
+
+    // columns: one per character that appears in a punctuator, and 0 for
+    // the rest
+    int col[256] = { 0 };
+    int num_cols = 1;
+    for (int n = 0; n < num_nodes; n++) {
+        for (int c = 0; c < 256; c++) {
+            if (child[n][c] && !col[c])
+                col[c] = num_cols++;
+        }
+    }
+
+    // states 0..num_nodes-1 follow the trie, num_nodes+n is the sink for n
+    int num_states = 2*num_nodes;
+    assert(num_states <= 256);
+    static int next[2*MAX_NODES*256];
+    static int typ[2*MAX_NODES], len[2*MAX_NODES];
+    for (int n = 0; n < num_nodes; n++) {
+        for (int c = 0; c < 256; c++) {
+            if (!col[c])
+                continue;
+            next[n*num_cols + col[c]] = child[n][c] ? child[n][c] : num_nodes + n;
+            next[(num_nodes + n)*num_cols + col[c]] = num_nodes + n;
+        }
+        next[n*num_cols] = num_nodes + n;
+        next[(num_nodes + n)*num_cols] = num_nodes + n;
+        typ[n] = typ[num_nodes + n] = best_typ[n];
+        len[n] = len[num_nodes + n] = best_len[n];
+    }
+
+    int cls[256] = { 0 };
+    for (int c = 0; c < 256; c++) {
+        if (strchr(" \t\r\f\v", c) && c)
+            cls[c] |= 1;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == '_')
+            cls[c] |= 2;
+        if (c >= '0' && c <= '9')
+            cls[c] |= 4;
+        if (strchr(PUNCT_CHARS, c) && c)
+            cls[c] |= 8;
+    }
+
+    printf("// generated by tools/gen_punct.c from tokenizer.h; do not edit\n\n");
+    printf("enum {\n");
+    printf("    CC_SPACE    = 1 << 0,   // horizontal whitespace\n");
+    printf("    CC_IDENT    = 1 << 1,   // letters, digits and '_'\n");
+    printf("    CC_DIGIT    = 1 << 2,\n");
+    printf("    CC_PUNCT    = 1 << 3,   // starts a punctuator\n");
+    printf("};\n\n");
+    printf("#define PUNCT_MAX_LEN %d\n\n", max_len);
+    print_table("static const uint8_t char_class[256]", cls, 256);
+    print_table("static const uint8_t punct_col[256]", col, 256);
+    printf("static const uint8_t punct_next[%d][%d] = {", num_states, num_cols);
+    for (int s = 0; s < num_states; s++) {
+        printf("\n    {");
+        for (int c = 0; c < num_cols; c++) {
+            printf("%s%d", c ? ", " : " ", next[s*num_cols + c]);
+        }
+        printf(" },");
+    }
+    printf("\n};\n\n");
+    print_table("static const uint16_t punct_typ[]", typ, num_states);
+    print_table("static const uint8_t punct_len[]", len, num_states);
+    return 0;
+}
@@ -0,0 +1,132 @@
+#include "xref.h"
+#include "arena.h"
+#include "ptrmap.h"
+#include <stdlib.h>
+#include <assert.h>
+
+// each name's chains, in the order names were first seen
+typedef struct {
+    uint32_t decls;     // newest entry of each chain, or 0
+    uint32_t uses;
+} xref_chains_t;
+
+static ptrmap_t name_idx;   // name -> 1 + its index in chains
+static xref_chains_t * chains;
+static size_t num_chains;
+static size_t chains_cap;
+
+// Entries are one array in a vm arena of their own, so they outlive
+// arena_reset() between translation units and grow without being copied.
+// Entry 0 is unused, so that 0 can end a chain.
+static arena_t entry_arena;
+static xref_t * entries;
+static size_t num_entries;
+
+static const char * kind_strs[] = {
+    [XREF_USE]          = "use",
+    [XREF_PARAM]        = "parameter",
+    [XREF_VAR_DECL]     = "variable declaration",
+    [XREF_VAR_DEF]      = "variable definition",
+    [XREF_FUNC_DECL]    = "function declaration",
+    [XREF_FUNC_DEF]     = "function definition",
+    [XREF_TYPEDEF]      = "typedef",
+};
+
+static xref_chains_t *
+find_chains(const char * name)
+{
+    uintptr_t i = (uintptr_t) ptrmap_get(&name_idx, name);
+    return i ? &chains[i-1] : NULL;
+}
+
+void
+xref_add(const char * name, xref_kind_t kind, uint32_t loc)
+{
+    assert(name);
+    if (!entries) {
+        entry_arena = arena_init_vm((size_t) 1 << 34, 0);
+        entries = arena_alloc(&entry_arena, sizeof(*entries));
+        num_entries = 1;
+    }
+    xref_chains_t * cp = find_chains(name);
+    if (!cp) {
+        if (num_chains >= chains_cap) {
+            chains_cap = chains_cap ? chains_cap*2 : 1024;
+            chains = realloc(chains, sizeof(*chains)*chains_cap);
+            assert(chains);
+        }
+        cp = &chains[num_chains++];
+        *cp = (xref_chains_t) {0};
+        ptrmap_put(&name_idx, name, (void *)(uintptr_t) num_chains);
+    }
+    uint32_t * head = (kind == XREF_USE) ? &cp->uses : &cp->decls;
+    xref_t * xp = arena_alloc(&entry_arena, sizeof(*xp));
+    assert(xp == &entries[num_entries]);
+    *xp = (xref_t) { .loc = loc, .next = *head, .name = (uint32_t)(cp - chains), .kind = kind };
+    *head = (uint32_t) num_entries++;
+}
+
+static const xref_t *
+entry(uint32_t i)
+{
+    return i ? &entries[i] : NULL;
+}
+
+// where name is declared or defined, newest first
+const xref_t *
+xref_decls(const char * name)
+{
+    xref_chains_t * cp = find_chains(name);
+    return cp ? entry(cp->decls) : NULL;
+}
+
+// where name is used in an expression, newest first
+const xref_t *
+xref_uses(const char * name)
+{
+    xref_chains_t * cp = find_chains(name);
+    return cp ? entry(cp->uses) : NULL;
+}
+
+const xref_t *
+xref_next(const xref_t * xp)
+{
+    return entry(xp->next);
+}
+
+const char *
+xref_kind_str(xref_kind_t kind)
+{
+    return kind_strs[kind];
+}
+
+size_t
+xref_mark()
+{
+    return num_entries;
+}
+
+// Forget the entries added since mark. Each is the newest of its chain when
+// its turn comes, so unlinking it is enough.
+void
+xref_rollback(size_t mark)
+{
+    if (!entries)
+        return;
+    // a mark from before the first entry
+    if (mark == 0)
+        mark = 1;
+    assert(mark <= num_entries);
+    while (num_entries > mark) {
+        xref_t * xp = &entries[--num_entries];
+        xref_chains_t * cp = &chains[xp->name];
+        if (xp->kind == XREF_USE)
+            cp->uses = xp->next;
+        else
+            cp->decls = xp->next;
+    }
+    arena_restore(&entry_arena, (arena_mark_t) {
+        .base = entry_arena.base,
+        .ptr = (uintptr_t) &entries[num_entries],
+    });
+}
@@ -0,0 +1,39 @@
+#ifndef XREF_H
+#define XREF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Cross-reference index of ordinary identifiers: for each name, where it is
+// declared or defined and where it is used in an expression, across every
+// translation unit parsed. The parser adds to it as it goes. Keyed by
+// interned name; each name's declarations and uses are chains of entries,
+// newest first. Like the symbol table, backtracking is a matter of rolling
+// back to a mark.
+
+typedef enum {
+    XREF_USE,
+    XREF_PARAM,
+    XREF_VAR_DECL,
+    XREF_VAR_DEF,
+    XREF_FUNC_DECL,
+    XREF_FUNC_DEF,
+    XREF_TYPEDEF,
+} xref_kind_t;
+
+typedef struct {
+    uint32_t loc;
+    uint32_t next;      // entry after this one in its chain, or 0
+    uint32_t name;      // index of the name this is an entry for
+    uint8_t kind;       // xref_kind_t
+} xref_t;
+
+void            xref_add(const char * name, xref_kind_t kind, uint32_t loc);
+const xref_t *  xref_decls(const char * name);
+const xref_t *  xref_uses(const char * name);
+const xref_t *  xref_next(const xref_t * xp);
+const char *    xref_kind_str(xref_kind_t kind);
+size_t          xref_mark();
+void            xref_rollback(size_t mark);
+
+#endif /* XREF_H */